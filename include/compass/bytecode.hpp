@@ -7,39 +7,45 @@ namespace amyinorbit::compass {
         loadg = 0x02,
         loadl = 0x03,
         loada = 0x04,
-        storeg = 0x05,
-        storel = 0x06,
-        storea = 0x07,
-        drop = 0x08,
-        dup = 0x09,
-        resv = 0x0a,
-        jmp = 0x0b,
-        rjmp = 0x0c,
-        jmpz = 0x0d,
-        rjmpz = 0x0e,
-        jmpnz = 0x0f,
-        rjmpnz = 0x10,
-        call = 0x11,
-        ret = 0x12,
-        ioselect = 0x13,
-        iowrite = 0x14,
-        ioread = 0x15,
-        iostyle = 0x16,
-        parse = 0x17,
-        i2s = 0x18,
-        i2f = 0x19,
-        f2s = 0x1a,
-        f2i = 0x1b,
-        addi = 0x1c,
-        subi = 0x1d,
-        muli = 0x1e,
-        divi = 0x1f,
-        cmpi = 0x20,
-        addf = 0x21,
-        subf = 0x22,
-        mulf = 0x23,
-        divf = 0x24,
-        cmpf = 0x25,
-        cmps = 0x26,
+        loadf = 0x05,
+        storeg = 0x06,
+        storel = 0x07,
+        storea = 0x08,
+        drop = 0x09,
+        dup = 0x0a,
+        resv = 0x0b,
+        jmp = 0x0c,
+        rjmp = 0x0d,
+        jmpz = 0x0e,
+        rjmpz = 0x0f,
+        jmpnz = 0x10,
+        rjmpnz = 0x11,
+        call = 0x12,
+        ret = 0x13,
+        ioselect = 0x14,
+        iowrite = 0x15,
+        ioread = 0x16,
+        iostyle = 0x17,
+        parse = 0x18,
+        i2s = 0x19,
+        i2f = 0x1a,
+        f2s = 0x1b,
+        f2i = 0x1c,
+        addi = 0x1d,
+        subi = 0x1e,
+        muli = 0x1f,
+        divi = 0x20,
+        cmpi = 0x21,
+        addf = 0x22,
+        subf = 0x23,
+        mulf = 0x24,
+        divf = 0x25,
+        cmpf = 0x26,
+        cmps = 0x27,
+        addll = 0x28,
+        cmpijz = 0x29,
+        writec = 0x2a,
+        loadfs = 0x2b,
+        cmpsa = 0x2c,
     };
 }
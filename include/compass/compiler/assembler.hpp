@@ -21,6 +21,9 @@ namespace amyinorbit::compass {
             , start_(source.unicode_scalars().begin()) {}
 
         void compile();
+
+        // The code assembled for each function, by name.
+        const map<string, vector<u8>>& functions() const { return functions_; }
     private:
 
         struct Token {
@@ -63,7 +66,8 @@ namespace amyinorbit::compass {
 
         void label();
         sema::Value literal();
-        void operand(Opcode inst);
+        // Encodes an integer operand as [size] little-endian bytes, or as a varint if [size] is 0.
+        void operand(i8 size);
 
         bool is(Token::Kind kind) const { return token_.kind == kind; }
         void expect(Token::Kind kind, const string& message = "unexpected token");
@@ -95,5 +99,8 @@ namespace amyinorbit::compass {
         unicode::scalar_iterator current_;
         unicode::scalar_iterator start_;
         Token token_;
+
+        vector<u8> code_;
+        map<string, vector<u8>> functions_;
     };
 }
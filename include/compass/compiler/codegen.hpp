@@ -11,6 +11,7 @@
 #include <compass/compiler/type.hpp>
 #include <compass/runtime2/bytecode.hpp>
 #include <compass/runtime2/bin_io.hpp>
+#include <compass/runtime2/function.hpp>
 #include <iostream>
 
 namespace amyinorbit::compass {
@@ -18,10 +19,14 @@ namespace amyinorbit::compass {
 
     class CodeGen {
     public:
-        using Writer = BinaryWriter;
+        // The story is built in memory, and handed to the stream in one write.
+        using Writer = BufferWriter;
 
         u16 add_constant(const Value& c);
+        const Value& constant(u16 idx) const { return constants_[idx]; }
         u16 add_object(const Object* c);
+        // Returns the function's index in the story, which Value(FunctionRef{index}) refers to.
+        u16 add_function(const string& name, const Function* fn);
         void write(std::ostream& out);
 
     private:
@@ -29,9 +34,11 @@ namespace amyinorbit::compass {
         void write_object(Writer& out, const Object* obj);
         void write_constant(Writer& out, const Value& c);
         void write_value(Writer& out, const Value& val);
+        void write_function(Writer& out, const string& name, const Function* fn);
 
         vector<Value> constants_;
         vector<const Object*> objects_;
         map<const Object*, u16> object_map_;
+        vector<std::pair<string, const Function*>> functions_;
     };
 }
@@ -0,0 +1,18 @@
+//===--------------------------------------------------------------------------------------------===
+// fusion.hpp - Superinstruction fusion pass
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#pragma once
+#include <compass/types.hpp>
+
+namespace amyinorbit::compass {
+
+    // Replaces common instruction sequences with a single superinstruction, so the interpreter
+    // dispatches once instead of two or three times. Sequences that a jump lands in the middle of
+    // are left alone.
+    vector<u8> fuse_superinstructions(const vector<u8>& code);
+}
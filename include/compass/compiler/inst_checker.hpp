@@ -1,5 +1,5 @@
 //===--------------------------------------------------------------------------------------------===
-// inst_checker.hpp - description
+// inst_checker.hpp - Static verifier for function bytecode
 //
 // Created by Amy Parent <amy@amyparent.com>
 // Copyright (c) 2019 Amy Parent
@@ -7,14 +7,47 @@
 // =^•.•^=
 //===--------------------------------------------------------------------------------------------===
 #pragma once
+#include <compass/types.hpp>
+#include <compass/runtime2/bytecode.hpp>
 
 namespace amyinorbit::compass {
 
+    /*
+    Walks every path through a function's bytecode before it is written to the story, and checks
+    that the VM can run it without looking: opcodes and operands are all there, jumps land on the
+    first byte of an instruction, no instruction pops more than the stack holds, every path reaches
+    an instruction with the same stack depth, and control never runs off the end.
+
+    Depths count from the top of the function's arguments, using the stack effects in bytecode.def
+    (resv and call, whose effect depends on their operand, are worked out here). The deepest point
+    is the function's max_stack, which the VM checks against the space left on the stack once per
+    call instead of on every push.
+    */
     class InstructionChecker {
     public:
+        InstructionChecker(const vector<u8>& code) : code_(code) {}
+
+        // Returns whether the code is safe to run. If not, error() says why.
+        bool check();
+
+        u16 max_stack() const { return max_stack_; }
+        const string& error() const { return error_; }
+        u32 error_offset() const { return error_offset_; }
 
     private:
-        
-    };
+        static constexpr i32 unvisited = -1;
 
+        bool fail(u32 offset, const string& message);
+
+        // Records that control can reach [offset] with [depth] values on the stack.
+        bool reach(u32 from, u32 offset, i32 depth, vector<u32>& pending);
+
+        const vector<u8>& code_;
+        vector<i32> depth_;     // stack depth on reaching each instruction, by code offset
+        vector<bool> starts_;   // whether each byte is the first of an instruction
+        u16 max_stack_ = 0;
+
+        string error_;
+        u32 error_offset_ = 0;
+    };
 }
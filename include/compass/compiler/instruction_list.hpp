@@ -0,0 +1,34 @@
+//===--------------------------------------------------------------------------------------------===
+// instruction_list.hpp - Decoded bytecode that compiler passes can rewrite
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#pragma once
+#include <compass/types.hpp>
+#include <compass/runtime2/bytecode.hpp>
+
+namespace amyinorbit::compass {
+
+    // Jump operands are decoded into the index of the instruction they land on, so passes can
+    // insert and remove instructions without tracking offsets. encode() turns them back into
+    // relative offsets.
+    struct Instruction {
+        Bytecode op;
+        u32 operand = 0;
+    };
+
+    using InstructionList = vector<Instruction>;
+
+    InstructionList decode(const vector<u8>& code);
+    vector<u8> encode(const InstructionList& instructions);
+
+    // Flags every instruction that a jump lands on.
+    vector<bool> jump_targets(const InstructionList& instructions);
+
+    // Removes the instructions flagged in [dead]. Jumps to a removed instruction are moved to the
+    // next instruction that survives.
+    void compact(InstructionList& instructions, const vector<bool>& dead);
+}
@@ -0,0 +1,30 @@
+//===--------------------------------------------------------------------------------------------===
+// peephole.hpp - Peephole and jump-threading optimiser
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#pragma once
+#include <compass/types.hpp>
+
+namespace amyinorbit::compass {
+    class CodeGen;
+
+    /*
+    Cleans up a function's bytecode before it is written, until there is nothing left to do:
+
+      - `loadc a; loadc b; addi` (and muli) on integer constants become a single `loadc a+b`,
+        whose constant is added to [codegen]'s pool.
+      - `dup; drop` and `loadl x; storel x` are removed.
+      - jumps that land on an unconditional jump go straight to its target, and so do conditional
+        jumps that land on a jump with the same condition (it tests the same value).
+      - jumps to the next instruction are removed.
+      - instructions that no path reaches, like the ones after a `jmp` or `ret`, are removed.
+
+    Sequences that a jump lands in the middle of are left alone. Run it before
+    fuse_superinstructions(), which expects the final instruction sequence.
+    */
+    vector<u8> optimise_bytecode(const vector<u8>& code, CodeGen& codegen);
+}
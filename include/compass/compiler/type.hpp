@@ -21,10 +21,11 @@ namespace amyinorbit::compass {
     using Array = vector<Value>;
 
     struct Property { string value; };
+    struct FunctionRef { u16 index; }; // index of a function in the story's function table
 
     struct Value {
 
-        enum Type { nil, integer, real, text, property, object, list };
+        enum Type { nil, integer, real, text, property, object, list, function };
 
         Value() : data_(nil_tag) {}
         Type type() const { return static_cast<Type>(data_.index()); }
@@ -37,7 +38,7 @@ namespace amyinorbit::compass {
         template <typename T> T& as() { return std::get<T>(data_); }
 
     private:
-        std::variant<nil_t, i32, float, string, Property, Ref, Array> data_;
+        std::variant<nil_t, i32, float, string, Property, Ref, Array, FunctionRef> data_;
     };
 
     bool operator==(const Value& left, const Value& right);
@@ -0,0 +1,29 @@
+//===--------------------------------------------------------------------------------------------===
+// atom.hpp - Process-wide interned strings
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#pragma once
+#include <compass/types.hpp>
+#include <string_view>
+
+namespace amyinorbit::compass::rt {
+
+    /*
+    Atoms are interned strings: every copy of the same text maps to the same 32-bit number, so
+    names, kinds and field keys can be compared and hashed as integers. The table is shared by the
+    whole process and never shrinks, so only strings that come from story files (names, keys,
+    constants) should be turned into atoms -- not text built at runtime.
+
+    Atom 0 is always the empty string.
+    */
+    using Atom = u32;
+
+    Atom atom(const string& str);
+    Atom atom(std::string_view str); // only copies text the table hasn't seen yet
+    inline Atom atom(const char* str) { return atom(std::string_view(str)); }
+    const string& text(Atom atom);
+}
@@ -10,8 +10,11 @@
 #include <compass/types.hpp>
 #include <apfun/maybe.hpp>
 #include <apfun/string.hpp>
+#include <cstring>
 #include <iostream>
 #include <stdexcept>
+#include <string_view>
+#include <type_traits>
 
 namespace amyinorbit::compass {
 
@@ -19,6 +22,7 @@ namespace amyinorbit::compass {
         data_object = 0xa0,
         data_list = 0xa1,
         data_utf8 = 0xa2,
+        data_function = 0xa3,
 
         value_int = 0xaa,
         value_float  = 0xab,
@@ -26,28 +30,201 @@ namespace amyinorbit::compass {
         ref_object = 0xad,
         ref_list = 0xae,
         ref_nil = 0xaf,
+        ref_function = 0xb0,
     };
 
-    class BinaryWriter {
-    public:
-        BinaryWriter(std::ostream& stream) : stream_(stream) {
-            stream_.imbue(std::locale::classic());
-            stream_.exceptions(std::ostream::failbit | std::ostream::badbit);
+    // MARK: - Encoding
+
+    // Anything that can be copied byte for byte can be read and written: integers, floats, tags.
+    template <typename T>
+    using EnableBinary = std::enable_if_t<std::is_trivially_copyable<T>::value && sizeof(T) <= 8>;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    constexpr bool host_little_endian = false;
+#else
+    constexpr bool host_little_endian = true;
+#endif
+
+    // Story files are little-endian. On little-endian hosts, values are loaded and stored with a
+    // single unaligned copy, which compilers turn into one move.
+    template <typename T, typename = EnableBinary<T>>
+    inline T load_le(const u8* data) {
+        T value;
+        if constexpr(host_little_endian) {
+            std::memcpy(&value, data, sizeof(T));
+        } else {
+            u8 bytes[sizeof(T)];
+            for(std::size_t i = 0; i < sizeof(T); ++i) bytes[i] = data[sizeof(T) - 1 - i];
+            std::memcpy(&value, bytes, sizeof(T));
+        }
+        return value;
+    }
+
+    template <typename T, typename = EnableBinary<T>>
+    inline void store_le(u8* data, T value) {
+        if constexpr(host_little_endian) {
+            std::memcpy(data, &value, sizeof(T));
+        } else {
+            u8 bytes[sizeof(T)];
+            std::memcpy(bytes, &value, sizeof(T));
+            for(std::size_t i = 0; i < sizeof(T); ++i) data[i] = bytes[sizeof(T) - 1 - i];
         }
+    }
 
-        template <typename T, std::enable_if_t<sizeof(T) == 4>* = nullptr>
+    // MARK: - Buffers
+
+    /*
+    Writes values into a growable buffer, which is the fast way to build a whole file: writes are
+    plain stores, and going back to patch a header is moving an offset. Writing past the end grows
+    the buffer. Strings are a u32 length (including a terminator that isn't written), then their
+    bytes.
+    */
+    class BufferWriter {
+    public:
+        template <typename T, typename = EnableBinary<T>>
         void write(T value) {
-            write_32(*reinterpret_cast<u32*>(&value));
+            store_le(take(sizeof(T)), value);
         }
 
-        template <typename T, std::enable_if_t<sizeof(T) == 2>* = nullptr>
-        void write(T value) {
-            write_16(*reinterpret_cast<u16*>(&value));
+        void write(const string& string) {
+            write((u32)string.size()+1);
+            write(string.data(), (u32)string.size());
+        }
+
+        void write(const char* data, u32 count) {
+            std::memcpy(take(count), data, count);
+        }
+
+        const u8* data() const {
+            return buffer_.data();
+        }
+
+        u64 size() const {
+            return buffer_.size();
+        }
+
+        void forward(u64 distance) {
+            go(offset_ + distance);
+        }
+
+        void backward(u64 distance) {
+            if(distance > offset_) throw std::out_of_range("seek before the start of the buffer");
+            go(offset_ - distance);
+        }
+
+        void go(u64 position) {
+            if(position > size()) throw std::out_of_range("seek past the end of the buffer");
+            offset_ = position;
+        }
+
+        u64 offset() const {
+            return offset_;
+        }
+
+    private:
+
+        // Moves past [count] bytes, growing the buffer if needed, and returns where they start.
+        u8* take(u64 count) {
+            if(offset_ + count > buffer_.size()) buffer_.resize(offset_ + count);
+            offset_ += count;
+            return buffer_.data() + offset_ - count;
+        }
+
+        vector<u8> buffer_;
+        u64 offset_ = 0;
+    };
+
+    /*
+    Reads values straight out of a buffer that holds a whole file (see MappedFile). Strings and byte
+    arrays can be read as views into the buffer, which are only valid for as long as it is. Reading
+    past the end throws std::out_of_range.
+    */
+    class BufferReader {
+    public:
+        BufferReader(const u8* data, u64 size) : data_(data), size_(size) {}
+
+        template <typename T, typename = EnableBinary<T>>
+        T read() {
+            return load_le<T>(read_bytes(sizeof(T)));
+        }
+
+        string read_string() {
+            auto view = read_view();
+            return string(view.data(), view.size());
+        }
+
+        // Reads a string without copying its text.
+        std::string_view read_view() {
+            auto size = read<u32>();
+            if(!size) throw std::out_of_range("invalid string length");
+            return {reinterpret_cast<const char*>(read_bytes(size - 1)), size - 1};
+        }
+
+        // Reads [count] bytes without copying them.
+        const u8* read_bytes(u64 count) {
+            return data_ + take(count);
+        }
+
+        void read(char* data, u32 count) {
+            std::memcpy(data, read_bytes(count), count);
+        }
+
+        u8 read_8() { return read<u8>(); }
+        u16 read_16() { return read<u16>(); }
+        u32 read_32() { return read<u32>(); }
+
+        u64 size() const {
+            return size_;
+        }
+
+        void forward(u64 distance) {
+            go(offset_ + distance);
+        }
+
+        void backward(u64 distance) {
+            if(distance > offset_) throw std::out_of_range("seek before the start of the buffer");
+            go(offset_ - distance);
+        }
+
+        void go(u64 position) {
+            if(position > size_) throw std::out_of_range("seek past the end of the buffer");
+            offset_ = position;
+        }
+
+        u64 offset() const {
+            return offset_;
+        }
+
+    private:
+
+        // Moves past [count] bytes, and returns the offset they start at.
+        u64 take(u64 count) {
+            if(count > size_ - offset_) throw std::out_of_range("read past the end of the buffer");
+            offset_ += count;
+            return offset_ - count;
+        }
+
+        const u8* data_;
+        u64 size_;
+        u64 offset_ = 0;
+    };
+
+    // MARK: - Streams
+
+    // The stream classes use the same encoding as the buffer ones, and hand each value to the
+    // stream in one call. Anything that reads or writes a whole file should use a buffer instead.
+    class BinaryWriter {
+    public:
+        BinaryWriter(std::ostream& stream) : stream_(stream) {
+            stream_.imbue(std::locale::classic());
+            stream_.exceptions(std::ostream::failbit | std::ostream::badbit);
         }
 
-        template <typename T, std::enable_if_t<sizeof(T) == 1>* = nullptr>
+        template <typename T, typename = EnableBinary<T>>
         void write(T value) {
-            write_8(*reinterpret_cast<u8*>(&value));
+            u8 bytes[sizeof(T)];
+            store_le(bytes, value);
+            write(reinterpret_cast<const char*>(bytes), sizeof(T));
         }
 
         void write(const string& string) {
@@ -85,23 +262,6 @@ namespace amyinorbit::compass {
 
     private:
 
-        void write_8(u8 data) {
-            stream_.put(data);
-        }
-
-        void write_16(u16 data) {
-            stream_.put(data & 0xff);
-            stream_.put((data >> 8) & 0xff);
-        }
-
-        bool write_32(u32 data) {
-            stream_.put(data & 0xff);
-            stream_.put((data >> 8) & 0xff);
-            stream_.put((data >> 16) & 0xff);
-            stream_.put((data >> 24) & 0xff);
-            return !stream_.fail();
-        }
-
         std::ostream& stream_;
     };
 
@@ -111,55 +271,28 @@ namespace amyinorbit::compass {
             stream_.exceptions(std::istream::failbit | std::istream::badbit);
         }
 
-        template <typename T, std::enable_if_t<sizeof(T) == 4>* = nullptr>
-        T read() {
-            u32 data = read_32();
-            return *reinterpret_cast<const T*>(&data);
-        }
-
-        template <typename T, std::enable_if_t<sizeof(T) == 2>* = nullptr>
-        T read() {
-            u16 data = read_16();
-            return *reinterpret_cast<const T*>(&data);
-        }
-
-        template <typename T, std::enable_if_t<sizeof(T) == 1>* = nullptr>
+        template <typename T, typename = EnableBinary<T>>
         T read() {
-            u8 data = read_8();
-            return *reinterpret_cast<const T*>(&data);
+            u8 bytes[sizeof(T)];
+            read(reinterpret_cast<char*>(bytes), sizeof(T));
+            return load_le<T>(bytes);
         }
 
         string read_string() {
             auto size = read<u32>();
-            string str;
-            str.reserve(size);
-            size -= 1;
-
-            while(size--) {
-                char c;
-                stream_.get(c);
-                str += c;
-            }
-            return str;;
+            if(!size) throw std::out_of_range("invalid string length");
+            vector<char> data(size - 1);
+            read(data.data(), size - 1);
+            return string(data.data(), data.size());
         }
 
-        u8 read_8() {
-            u8 data;
-            stream_.read((char*)&data, 1);
-            return data;
+        void read(char* data, u32 count) {
+            stream_.read(data, count);
         }
 
-        u16 read_16() {
-            u8 data[2];
-            stream_.read(reinterpret_cast<char*>(data), 2);
-            return data[0] | (data[1] << 8);
-        }
-
-        u32 read_32() {
-            u8 data[4];
-            stream_.read(reinterpret_cast<char*>(data), 4);
-            return data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24);
-        }
+        u8 read_8() { return read<u8>(); }
+        u16 read_16() { return read<u16>(); }
+        u32 read_32() { return read<u32>(); }
 
         u64 size() const {
             auto current = stream_.tellg();
@@ -7,13 +7,161 @@
 // =^•.•^=
 //===--------------------------------------------------------------------------------------------===
 #pragma once
+#include <compass/types.hpp>
 
 namespace amyinorbit::compass {
 
-    #define OPCODE(name, value, _, __) name = value,
-    enum class Bytecode {
+    /*
+    Code is a string of bytes. Each instruction is a one-byte opcode followed by its operand, which
+    is either a fixed-size little-endian integer, or one or more varints: 7 bits a byte, low bits
+    first, with the top bit set on every byte but the last. Constant and global indices are varints,
+    since most of them fit in a byte. Local indices are single bytes. Jump offsets are always two
+    bytes, so that jumps can be patched in place, and count from the first byte of the operand.
+
+    Compiler passes see every operand as one u32, and instructions with two varints (loadf) keep the
+    second one in the high 16 bits. read_operand() and write_operand() convert between the two.
+    */
+
+    #define OPCODE(name, value, _, __, ___) name = value,
+    enum class Bytecode : u8 {
     #include "bytecode.x.hpp"
     };
     #undef OPCODE
 
+    #define OPCODE(name, value, _, __, ___) + 1
+    constexpr u16 opcode_count = 0
+    #include "bytecode.x.hpp"
+    ;
+    #undef OPCODE
+
+    struct InstructionInfo {
+        const char* mnemonic;
+        u8 operands;    // fixed operand size, in bytes
+        u8 varints;     // number of varint operands
+        i8 stack;       // stack effect
+    };
+
+    inline const InstructionInfo& info(Bytecode op) {
+        #define OPCODE(name, _, operands, varints, stack) {#name, operands, varints, stack},
+        static const InstructionInfo table[] = {
+        #include "bytecode.x.hpp"
+        };
+        #undef OPCODE
+        return table[static_cast<u16>(op)];
+    }
+
+    // MARK: - Encoding
+
+    // Varint operands hold 16-bit indices, which never take more than this.
+    constexpr u8 max_varint_size = 3;
+
+    inline u32 read_varint(const u8*& p) {
+        u32 value = 0;
+        for(u8 shift = 0;; shift += 7) {
+            u8 byte = *p++;
+            value |= u32(byte & 0x7f) << shift;
+            if(!(byte & 0x80)) return value;
+        }
+    }
+
+    inline void write_varint(vector<u8>& code, u32 value) {
+        while(value >= 0x80) {
+            code.push_back(u8(value) | 0x80);
+            value >>= 7;
+        }
+        code.push_back(u8(value));
+    }
+
+    inline u8 varint_size(u32 value) {
+        u8 size = 1;
+        while(value >= 0x80) {
+            value >>= 7;
+            size += 1;
+        }
+        return size;
+    }
+
+    inline u16 read_u16(const u8* p) {
+        return u16(p[0] | (p[1] << 8));
+    }
+
+    inline void write_u16(u8* p, u16 value) {
+        p[0] = value & 0xff;
+        p[1] = value >> 8;
+    }
+
+    // Reads the operand of [op] at [p], and moves [p] past it.
+    inline u32 read_operand(Bytecode op, const u8*& p) {
+        const auto& inst = info(op);
+        u32 operand = 0;
+        if(inst.varints) {
+            operand = read_varint(p);
+            if(inst.varints > 1) operand |= read_varint(p) << 16;
+        } else {
+            for(u8 i = 0; i < inst.operands; ++i) operand |= u32(*p++) << (8 * i);
+        }
+        return operand;
+    }
+
+    inline void write_operand(vector<u8>& code, Bytecode op, u32 operand) {
+        const auto& inst = info(op);
+        if(inst.varints) {
+            write_varint(code, inst.varints > 1 ? operand & 0xffff : operand);
+            if(inst.varints > 1) write_varint(code, operand >> 16);
+        } else {
+            for(u8 i = 0; i < inst.operands; ++i) code.push_back((operand >> (8 * i)) & 0xff);
+        }
+    }
+
+    // The size of [op] and its [operand] once encoded, opcode included.
+    inline u32 encoded_size(Bytecode op, u32 operand) {
+        const auto& inst = info(op);
+        if(!inst.varints) return 1 + inst.operands;
+        if(inst.varints == 1) return 1 + varint_size(operand);
+        return 1 + varint_size(operand & 0xffff) + varint_size(operand >> 16);
+    }
+
+    // The size of the instruction at [ip], opcode included.
+    inline u32 instruction_size(const u8* ip) {
+        const u8* p = ip + 1;
+        read_operand(static_cast<Bytecode>(*ip), p);
+        return p - ip;
+    }
+
+    inline bool is_jump(Bytecode op) {
+        switch(op) {
+        case Bytecode::jmp:
+        case Bytecode::rjmp:
+        case Bytecode::jmpz:
+        case Bytecode::rjmpz:
+        case Bytecode::jmpnz:
+        case Bytecode::rjmpnz:
+        case Bytecode::cmpijz:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    inline bool is_backward_jump(Bytecode op) {
+        return op == Bytecode::rjmp || op == Bytecode::rjmpz || op == Bytecode::rjmpnz;
+    }
+
+    // MARK: - Quickening
+
+    // Quickened instructions only exist in decoded images (see Function::Instruction): the
+    // interpreter rewrites a generic instruction into one of them once it has seen the types it
+    // works on, and back if they change. They take the same operands as their generic form, and
+    // never appear in bytecode.
+    inline bool is_quickened(Bytecode op) {
+        return op == Bytecode::loadfs || op == Bytecode::cmpsa;
+    }
+
+    inline Bytecode generic_form(Bytecode op) {
+        switch(op) {
+        case Bytecode::loadfs: return Bytecode::loadf;
+        case Bytecode::cmpsa: return Bytecode::cmps;
+        default: return op;
+        }
+    }
 }
@@ -9,26 +9,105 @@
 #pragma once
 #include <compass/runtime2/type.hpp>
 #include <compass/runtime2/buffer.hpp>
+#include <compass/runtime2/pool.hpp>
+#include <compass/runtime2/telemetry.hpp>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <new>
 #include <utility>
 
 namespace amyinorbit::compass::rt {
 
+    // How much marking a single incremental slice may do. Zero means no limit.
+    struct SliceBudget {
+        u32 work = 256;                         // cells traced
+        std::chrono::microseconds time{0};      // wall-clock time
+    };
+
+    /*
+    The collector is generational. New cells go into the nursery, which is collected on its own
+    (a minor collection) whenever it fills up: only cells reachable from the roots or from the
+    remembered set are traced, and old cells are never visited. Survivors are promoted to the old
+    generation straight away -- most of what a turn allocates is temporary text, while the world
+    graph lives for the whole session.
+
+    Once the old generation has grown past a threshold, the next collection is a full one instead.
+    Its threshold is set from how much survived the last full collection.
+
+    Old cells that get a reference stored into them must go through write_barrier(), so that
+    young cells they point to are found by minor collections.
+
+    Full collections can be made incremental: marking then proceeds in slices, one per
+    allocation (and one per call to step()), each bounded by a SliceBudget.
+    */
     class Collector {
     public:
         static constexpr u16 default_collection_threshold = 64;
+        static constexpr u16 nursery_size = 256;
+        static constexpr u16 mark_stack_size = 1024;  // initial capacity, it grows as needed
         static constexpr float growth_factor = 1.75;
 
         using Delegate = std::function<void(Collector&)>;
 
+
         Collector();
+        ~Collector();
 
-        Object* new_object(const Object* prototype, const string& name);
+        Object* new_object(const Object* prototype, Atom name);
         Object* clone(const Object* object);
+        String* new_string(const string& data, Atom atom = String::no_atom);
+        // The string points to [data] instead of copying it. Whoever owns [data] must keep it for
+        // as long as the collector is alive.
+        String* new_string_view(std::string_view data, Atom atom);
+        List* new_list(vector<Value> items = {});
+
+        // Lists belong to whatever holds them, so copying one copies its items too, lists
+        // included. Anything else is shared. [value] must be reachable from a root.
+        Value copy(const Value& value);
 
         void mark(const Value& value);
-        void mark(const Object* object);
+        void mark(const Cell* cell);
+        void mark(const vector<Value>& values);
+
+        void write_barrier(const Cell* cell) {
+            if(!cell->gc.old) return;
+            if(!cell->gc.remembered) remember(cell);
+            if(phase_ == Phase::marking && is_marked(cell) && !cell->gc.grey) shade(cell);
+        }
+
+        void set_incremental(bool enabled, SliceBudget budget = {});
+
+        // Full collections that aren't incremental can mark on several threads. With one thread
+        // (the default), marking is serial.
+        void set_mark_threads(u32 count);
+        u32 mark_threads() const { return mark_threads_; }
+        bool is_marking() const { return phase_ == Phase::marking; }
+
+        // Minor collections only mark young cells. Delegates can skip roots that can't hold one.
+        bool is_minor() const { return scope_ == Scope::young; }
+
+        // Runs one marking slice, if an incremental collection is underway. Hosts can call this
+        // when they are idle, like while waiting for input.
+        void step();
+
+        // MARK: - Telemetry
+        // The collector doesn't log anything. Hosts can poll these, or read last_collection() from
+        // the delegates: before_collection sees the kind and trigger of the collection about to
+        // mark, after_collection sees the whole event once a collection cycle is complete.
 
-        void push_root(Object* obj) { roots_.push_back(obj); }
+        const CollectionEvent& last_collection() const { return event_; }
+        const GCCounters& counters() const { return counters_; }
+        const PauseHistogram& pauses() const { return pauses_; }
+        void reset_telemetry();
+
+        ShapeTree& shapes() { return shapes_; }
+
+        u32 heap_cells() const { return old_count_ + nursery_count_; }
+        u64 heap_bytes() const { return heap_bytes_; }
+
+        void push_root(Cell* cell) { roots_.push_back(cell); }
         void pop_root() { roots_.pop_back(); }
 
         void pause() { is_paused_ = true; }
@@ -38,25 +117,101 @@ namespace amyinorbit::compass::rt {
         Delegate after_collection{};
 
     private:
+        enum class Phase : u8 { idle, marking };
 
-        void default_before_collection() {
-            std::cout << "[gc]: garbage collection starting: " << allocated_ << " objects\n";
-        }
+        // Declared first so that it outlives the objects that point into it.
+        ShapeTree shapes_;
 
-        void default_after_collection() {
-            std::cout << "[gc]: garbage collection done: " << allocated_ << " objects\n";
+        // Which generation marking is allowed to touch.
+        enum class Scope : u8 { young, old, all };
+
+        struct Workers;
+
+        bool is_marked(const Cell* cell) const {
+            return cell->gc.stage.load(std::memory_order_relaxed) == stage_;
         }
 
-        void take(Object* obj);
+        void take(Cell* cell);
+        void remember(const Cell* cell);
+        bool in_scope(const Cell* cell) const;
+        void shade(const Cell* cell);
+        void trace(const Cell* cell);
+        void trace_next();
+        void drain(u32 floor);
+        void drain_parallel();
+
+        // Calls [f] with every cell that [cell] points to.
+        template <typename F> static void each_child(const Cell* cell, F&& f);
+
         void collect();
+        void collect_minor();
+        void collect_major();
+        void begin_major();
+        void finish_major();
+        void sweep();
+        void promote(Cell* cell);
+        void forget_remembered();
+
+        // Cells are allocated from a slab pool for their size class, rather than one by one.
+        static constexpr u32 size_class = alignof(std::max_align_t);
+        static constexpr u32 size_classes = 16;
+
+        Pool& pool(u32 size);
+
+        template <typename T, typename... Args>
+        T* make(Args&&... args) {
+            auto& from = pool(sizeof(T));
+            heap_bytes_ += from.cell_size();
+            counters_.cells_allocated += 1;
+            counters_.bytes_allocated += from.cell_size();
+            return new (from.alloc()) T(std::forward<Args>(args)...);
+        }
+
+        template <typename T>
+        u32 dispose(T* cell) {
+            auto& into = pool(sizeof(T));
+            cell->~T();
+            into.dealloc(cell);
+            heap_bytes_ -= into.cell_size();
+            return into.cell_size();
+        }
+
+        // Returns the number of bytes given back to the pools.
+        u32 destroy(Cell* cell);
+        void reclaim(Cell* cell);
+
+        void begin_pause(CollectionEvent::Kind kind, CollectionEvent::Trigger trigger);
+        void end_pause();
+        void slice(CollectionEvent::Trigger trigger);
 
         bool stage_ = false;
-        Object* head_{nullptr};
-        u16 allocated_{0};
-        u16 next_collection_{64};
+        Phase phase_ = Phase::idle;
+        Scope scope_ = Scope::all;
+
+        bool is_incremental_ = false;
+        SliceBudget budget_{};
+        vector<const Cell*> grey_;     // The mark stack.
+
+        u64 heap_bytes_ = 0;
+        CollectionEvent event_{};
+        GCCounters counters_{};
+        PauseHistogram pauses_{};
+        std::chrono::steady_clock::time_point pause_start_{};
+
+        u32 mark_threads_ = 1;
+        std::unique_ptr<Workers> workers_;
+
+        Cell* nursery_{nullptr};
+        Cell* head_{nullptr};
+        u32 nursery_count_{0};
+        u32 old_count_{0};
+        u32 marked_{0};
+        u32 next_major_{default_collection_threshold};
         bool is_paused_{false};
 
-        buffer<Object*> roots_{64};
+        std::array<std::unique_ptr<Pool>, size_classes> pools_;
+        vector<const Cell*> remembered_;
+        buffer<Cell*> roots_{64};
 
     };
 }
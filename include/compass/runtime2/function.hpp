@@ -10,15 +10,55 @@
 #pragma once
 #include <compass/types.hpp>
 #include <compass/runtime2/bytecode.hpp>
+#include <compass/runtime2/shape.hpp>
+#include <compass/runtime2/type.hpp>
+#include <cassert>
 
 namespace amyinorbit::compass {
-    class Machine;
-    class Object;
-
 
     class Function : NonCopyable, NonMovable {
     public:
-        const u16* ip() const { return &bytecode_.front(); }
+        /*
+        One instruction of a function's decoded image, which is what the interpreter runs. The
+        VM decodes each function the first time it is called (see VM::decode()): constant and
+        global indices become pointers to their slots, jump offsets become pointers to the
+        instruction they land on, and loadf gets a pointer to its cache. The image has one
+        instruction for each one in the bytecode, in the same order, and the bytecode stays around
+        as the portable form.
+        */
+        struct Instruction {
+            Bytecode op;
+            u8 a = 0;                               // local index or argument count
+            u8 b = 0;                               // addll's second local
+            u16 index = 0;                          // global index, device, style or cache
+            u32 offset = 0;                         // where the instruction is in the bytecode
+            union {
+                const rt::Value* constant = nullptr; // loadc, writec, and the name in loadf
+                rt::Value* global;                  // loadg, storeg
+                const Instruction* target;          // jumps
+            };
+            rt::FieldCache* cache = nullptr;        // loadf
+        };
+
+        Function() = default;
+        Function(vector<u8> bytecode, u16 max_stack = 0);
+        // Points at [size] bytes of code that belong to someone else -- a loaded story's data,
+        // which must outlive the function. Nothing is read until the function is decoded.
+        Function(const u8* code, u32 size, u16 max_stack);
+
+        // The code of a function the compiler is building. Loaded functions only have ip().
+        const vector<u8>& code() const {
+            assert(!external_ && "loaded functions don't own their code");
+            return bytecode_;
+        }
+
+        const u8* ip() const { return external_ ? external_ : bytecode_.data(); }
+        u32 size() const { return external_ ? external_size_ : bytecode_.size(); }
+
+        // The deepest the function takes the stack above its arguments, as worked out by the
+        // bytecode verifier (see compiler/inst_checker.hpp). The VM checks that much space is left
+        // once per call, so the code itself doesn't need to.
+        u16 max_stack() const { return max_stack_; }
 
         void emit(Bytecode inst);
         void emit(Bytecode inst, u16 constant);
@@ -26,7 +66,36 @@ namespace amyinorbit::compass {
         u16 emitJump(Bytecode inst);
         void patchJump(u16 id);
 
+        // Emits a loadf instruction, with its own inline cache slot.
+        void emitField(u16 name);
+
+        rt::FieldCache& cache(u16 idx) const { return caches_[idx]; }
+
+        // Loaded functions only know how many caches their loadf instructions use once they are
+        // decoded. Caches must not move once instructions point to them, so this happens first.
+        void reserve_caches(u16 count) const {
+            assert(!decoded() && "caches resized after decoding");
+            if(count > caches_.size()) caches_.resize(count);
+        }
+
+        const Instruction* image() const { return image_.data(); }
+        bool decoded() const { return !image_.empty(); }
+        void set_image(vector<Instruction> image) const { image_ = std::move(image); }
+
+        // Rewrites the opcode of [inst], in the image, into [op], which must take the same
+        // operands. The VM uses it to quicken instructions (see bytecode.hpp).
+        void quicken(const Instruction* inst, Bytecode op) const {
+            assert(inst >= image() && inst < image() + image_.size() && "not in this function");
+            assert(generic_form(op) == generic_form(inst->op));
+            image_[inst - image()].op = op;
+        }
+
     private:
-        std::vector<u16> bytecode_;
+        std::vector<u8> bytecode_;
+        const u8* external_ = nullptr;
+        u32 external_size_ = 0;
+        mutable vector<Instruction> image_;
+        mutable vector<rt::FieldCache> caches_;
+        u16 max_stack_ = 0;
     };
 }
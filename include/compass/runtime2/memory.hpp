@@ -9,15 +9,51 @@
 #pragma once
 #include <compass/types.hpp>
 #include <cstddef>
+#include <iosfwd>
+#include <set>
 #include <type_traits>
+#include <utility>
 
 namespace amyinorbit::compass {
 
+    /*
+    Memory hands out blocks from one contiguous buffer, addressed by offsets from its start. Where
+    the platform allows it, the buffer is only a reservation of address space: pages are committed
+    by the OS the first time they are touched, so an untouched region costs next to nothing.
+
+    Free blocks are kept in segregated lists: small blocks in one list per exact size (so most
+    allocations are a pop off the right list, found with a bitmap), and large blocks in a tree
+    ordered by size, searched for the best fit. Blocks carry boundary tags, so a freed block is
+    merged with free neighbours in constant time.
+    */
     class Memory {
     public:
         using size_type = u32;
 
-        Memory(size_type capacity);
+        // Blocks are a whole number of [align]-byte slots. Those under [small_limit] bytes have
+        // exact-size free lists, larger ones share the tree.
+        static constexpr size_type align = 8;
+        static constexpr size_type small_limit = 64 * align;
+
+        // Regions that are touched all the time can ask for transparent huge pages, which cuts
+        // TLB misses at the cost of committing memory in 2MB chunks. Ignored where unsupported.
+        enum class Paging : u8 { normal, huge };
+
+        struct Stats {
+            size_type capacity = 0;     // bytes usable for blocks and their tags
+            size_type used = 0;         // bytes in allocated blocks, tags not included
+            size_type free = 0;         // bytes in free blocks, tags not included
+            size_type largest_free = 0; // the largest allocation that can currently succeed
+            u32 used_blocks = 0;
+            u32 free_blocks = 0;
+
+            // 0 when all free memory is in one block, approaching 1 as it gets scattered.
+            float fragmentation() const {
+                return free ? 1.f - float(largest_free) / float(free) : 0.f;
+            }
+        };
+
+        Memory(size_type capacity, Paging paging = Paging::normal);
         Memory(const Memory& other) = delete;
         Memory(Memory&& other);
         ~Memory();
@@ -30,51 +66,152 @@ namespace amyinorbit::compass {
             return reinterpret_cast<const void*>(data_ + address);
         }
 
-        template <typename T, std::enable_if_t<sizeof(T) <= 4>* = nullptr>
+        template <typename T, std::enable_if_t<sizeof(T) <= 8>* = nullptr>
         T* ptr(size_type address) {
             return reinterpret_cast<T*>(data_ + address);
         }
 
-        template <typename T, std::enable_if_t<sizeof(T) <= 4>* = nullptr>
+        template <typename T, std::enable_if_t<sizeof(T) <= 8>* = nullptr>
         const T* ptr(size_type address) const {
             return reinterpret_cast<const T*>(data_ + address);
         }
 
-        template <typename T, std::enable_if_t<sizeof(T) <= 4>* = nullptr>
+        template <typename T, std::enable_if_t<sizeof(T) <= 8>* = nullptr>
         void write(size_type address, const T& value) {
             T* dest = reinterpret_cast<T*>(data_ + address);
             *dest = value;
         }
 
-        template <typename T, std::enable_if_t<sizeof(T) <= 4>* = nullptr>
+        template <typename T, std::enable_if_t<sizeof(T) <= 8>* = nullptr>
         const T& read(size_type address) const {
             const T* dest = reinterpret_cast<const T*>(data_ + address);
             return *dest;
         }
 
+        // Returns the address of a block of [slots] 8-byte slots, or 0 if there is no room. The
+        // first block allocated from a new Memory is zero-filled.
         size_type alloc(size_type slots);
         void dealloc(size_type address);
 
+        Stats stats() const;
+        // Checks the block layout and free lists are consistent. This walks the whole buffer.
+        bool verify() const;
         void debug(const string& marker = "") const;
 
     private:
 
-        static constexpr size_type align = 4;
-        static constexpr size_type block_header_size = 3 * align;
-        static constexpr size_type relax_param = 10;
+        static constexpr size_type first_block = align;
+
+        // Boundary tags: each block starts with a header and ends with a footer that both hold
+        // its payload size and free flag. The footer lets a block find its physical predecessor,
+        // so freed blocks merge with both neighbours without walking the buffer.
+        static constexpr size_type block_header_size = align;
+        static constexpr size_type block_footer_size = align;
+        static constexpr size_type block_overhead = block_header_size + block_footer_size;
+        static constexpr size_type tag_size_offset = 0;
+        static constexpr size_type tag_free_offset = 4;
 
-        static constexpr size_type block_size_offset = 0 * align;
-        static constexpr size_type block_free_offset = 1 * align;
-        static constexpr size_type block_next_offset = 2 * align;
+        // Free blocks link to their neighbours in their size class through their payload.
+        static constexpr size_type free_prev_offset = block_header_size;
+        static constexpr size_type free_next_offset = block_header_size + 4;
+        static constexpr size_type min_payload = align;
 
+        static constexpr size_type small_classes = small_limit / align;
+
+        size_type take(size_type size);
         void split(size_type block, size_type size);
-        void merge();
+        void tag(size_type block, size_type size, bool free);
+
+        void bin(size_type block);
+        void unbin(size_type block);
+
+        size_type block_size(size_type block) const {
+            return ref<size_type>(block + tag_size_offset);
+        }
+
+        bool is_free(size_type block) const {
+            return ref<u32>(block + tag_free_offset);
+        }
+
+        size_type footer(size_type block) const {
+            return block + block_header_size + block_size(block);
+        }
+
+        // The blocks physically before and after [block], or 0 at either end of the buffer.
+        size_type next_block(size_type block) const {
+            size_type next = footer(block) + block_footer_size;
+            return next < end_ ? next : 0;
+        }
+
+        size_type prev_block(size_type block) const {
+            if(block == first_) return 0;
+            size_type prev_footer = block - block_footer_size;
+            return prev_footer - ref<size_type>(prev_footer + tag_size_offset) - block_header_size;
+        }
 
         template <typename T> T& ref(size_type address) { return *ptr<T>(address); }
         template <typename T> const T& ref(size_type address) const { return *ptr<T>(address); }
 
         u8* data_ = nullptr;
         size_type capacity_ = 0;
-        size_type free_list_ = 0;
+        size_type first_ = 0;
+        size_type end_ = 0;
+
+        size_type small_[small_classes] = {};  // heads of the small free lists, by size / align
+        u64 small_map_ = 0;                     // bit n is set when small_[n] isn't empty
+        std::set<std::pair<size_type, size_type>> large_; // (size, address) of large free blocks
+    };
+
+    /*
+    A fixed buffer with an inaccessible guard page on either side, so code that runs off one end
+    faults straight away instead of scribbling over whatever is next to it. Where the platform
+    has no way to protect pages, or protecting them fails, the guards are missing and guard_at()
+    never finds one.
+    */
+    class GuardedRegion {
+    public:
+        using size_type = Memory::size_type;
+        enum class Guard : u8 { none, below, above };
+
+        GuardedRegion(size_type capacity, Memory::Paging paging = Memory::Paging::normal);
+        GuardedRegion(const GuardedRegion& other) = delete;
+        ~GuardedRegion();
+
+        u8* begin() const { return data_; }
+        u8* end() const { return data_ + capacity_; }
+
+        // Which guard page, if any, [address] falls in.
+        Guard guard_at(const void* address) const;
+
+    private:
+        u8* data_ = nullptr;
+        size_type capacity_ = 0;
+        size_type guard_size_ = 0;
+    };
+
+    /*
+    A file mapped read-only into memory. The OS reads each page from disk the first time it is
+    touched, and can drop it again under pressure, so mapping a large file costs about as much as
+    the parts that get used. Where the platform can't map files, the whole file is read into a
+    buffer instead, and so is a stream. A file that can't be opened maps to nothing: size() is 0.
+    */
+    class MappedFile {
+    public:
+        // Not Memory::size_type: a file can be larger than the 32-bit offsets the heap uses.
+        using size_type = std::size_t;
+
+        MappedFile(const char* path);
+        MappedFile(std::istream& in);
+        MappedFile(const MappedFile& other) = delete;
+        ~MappedFile();
+
+        const u8* data() const { return data_; }
+        size_type size() const { return size_; }
+
+    private:
+        const u8* data_ = nullptr;
+        size_type size_ = 0;
+        bool mapped_ = false;
+        vector<u8> buffer_; // when the file couldn't be mapped, or is a stream
     };
 }
@@ -0,0 +1,60 @@
+//===--------------------------------------------------------------------------------------------===
+// pool.hpp - Slab allocator for fixed-size collector cells
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#pragma once
+#include <compass/types.hpp>
+#include <memory>
+
+namespace amyinorbit::compass::rt {
+
+    /*
+    Hands out cells of one size, carved out of large slabs. Freed cells go on a free list and are
+    reused before the slab is bumped any further. Slabs are only given back to the system when the
+    pool is destroyed, all at once -- whatever is still in them must have been destroyed by then.
+    */
+    class Pool : NonCopyable {
+    public:
+        static constexpr u32 slab_size = 64 * 1024;
+
+        Pool(u32 cell_size);
+
+        void* alloc() {
+            if(free_) {
+                auto cell = free_;
+                free_ = free_->next;
+                return cell;
+            }
+            if(bump_ == end_) grow();
+            auto cell = bump_;
+            bump_ += cell_size_;
+            return cell;
+        }
+
+        void dealloc(void* ptr) {
+            auto cell = static_cast<FreeCell*>(ptr);
+            cell->next = free_;
+            free_ = cell;
+        }
+
+        u32 cell_size() const { return cell_size_; }
+        u32 slabs() const { return slabs_.size(); }
+
+    private:
+        struct FreeCell {
+            FreeCell* next;
+        };
+
+        void grow();
+
+        u32 cell_size_;
+        FreeCell* free_ = nullptr;
+        u8* bump_ = nullptr;
+        u8* end_ = nullptr;
+        vector<std::unique_ptr<u8[]>> slabs_;
+    };
+}
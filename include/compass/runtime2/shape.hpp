@@ -0,0 +1,106 @@
+//===--------------------------------------------------------------------------------------------===
+// shape.hpp - Shared object layouts and field inline caches
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#pragma once
+#include <compass/types.hpp>
+#include <compass/runtime2/atom.hpp>
+#include <memory>
+
+namespace amyinorbit::compass::rt {
+
+    /*
+    A shape (or hidden class) maps field names to slots in an object. Objects that got the same
+    fields in the same order share the same shape, so a field access only has to look the name up
+    the first time it sees a shape -- after that, the shape pointer is enough to find the slot.
+
+    Shapes form trees: adding a field to an object moves it to a child shape. Objects without a
+    prototype start at the empty shape, and the heirs of each prototype start at a root of their
+    own, so a shape also tells which prototype chain is behind an object. Every tree belongs to a
+    ShapeTree, which the collector owns.
+    */
+    class Shape : NonCopyable {
+    public:
+        static constexpr i32 not_found = -1;
+
+        const Shape* with(Atom field) const;
+        i32 slot(Atom field) const;
+
+        u16 size() const { return fields_.size(); }
+        Atom field(u16 slot) const { return fields_[slot]; }
+
+    private:
+        friend class ShapeTree;
+
+        Shape() = default;
+        Shape(const Shape& parent, Atom field);
+
+        vector<Atom> fields_;
+        map<Atom, u16> slots_;
+        mutable map<Atom, std::unique_ptr<Shape>> transitions_;
+    };
+
+    /*
+    The shapes of one collector's objects, which all go when it does. Only the session that owns
+    the collector creates shapes, so transitions don't need a lock.
+
+    The epoch is bumped whenever an object that has heirs gets a new field, which may shadow a
+    field that inline caches found further up the chain (see FieldCache).
+    */
+    class ShapeTree : NonCopyable, NonMovable {
+    public:
+        const Shape* empty() const { return &empty_; }
+
+        // Creates a new, empty root shape.
+        const Shape* root();
+
+        u32 epoch() const { return epoch_; }
+        void bump_epoch() { epoch_ += 1; }
+
+    private:
+        Shape empty_;
+        vector<std::unique_ptr<Shape>> roots_;
+        u32 epoch_ = 0;
+    };
+
+    // Inline cache for one field-access instruction. It remembers the slot the field was found in
+    // for the last few shapes it has seen. One entry is a monomorphic site, several a polymorphic
+    // one; once it is full, misses fall back to a shape lookup without being cached.
+    //
+    // Fields that are inherited are found [depth] prototypes up the chain. Those entries are only
+    // valid as long as no prototype gets a new field, which [epoch] keeps track of.
+    struct FieldCache {
+        static constexpr u8 ways = 4;
+
+        struct Entry {
+            const Shape* shape = nullptr;
+            u16 slot = 0;
+            u16 depth = 0;
+            u32 epoch = 0;
+        };
+
+        const Entry* find(const Shape* shape) const {
+            for(u8 i = 0; i < size; ++i) {
+                if(entries[i].shape == shape) return &entries[i];
+            }
+            return nullptr;
+        }
+
+        void insert(const Entry& entry) {
+            for(u8 i = 0; i < size; ++i) {
+                if(entries[i].shape == entry.shape) {
+                    entries[i] = entry;
+                    return;
+                }
+            }
+            if(size < ways) entries[size++] = entry;
+        }
+
+        Entry entries[ways];
+        u8 size = 0;
+    };
+}
@@ -0,0 +1,98 @@
+//===--------------------------------------------------------------------------------------------===
+// telemetry.hpp - Garbage collector statistics
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#pragma once
+#include <compass/types.hpp>
+#include <algorithm>
+#include <chrono>
+
+namespace amyinorbit::compass::rt {
+
+    // One pause of the collector: a whole minor or full collection, or one incremental slice.
+    struct CollectionEvent {
+        enum class Kind : u8 { minor, full, slice };
+        enum class Trigger : u8 {
+            nursery_full,       // an allocation filled the nursery
+            old_generation,     // the old generation grew past its threshold
+            allocation,         // incremental marking keeping up with allocations
+            host,               // the host asked for it (Collector::step(), set_incremental())
+        };
+
+        Kind kind = Kind::minor;
+        Trigger trigger = Trigger::nursery_full;
+        bool completes_cycle = false;   // false for slices that leave marking unfinished
+
+        std::chrono::nanoseconds pause{0};
+        u32 marked = 0;
+        u32 swept = 0;
+        u64 bytes_reclaimed = 0;
+
+        // Heap size once the pause is over. Bytes only count cell storage, not the buffers that
+        // strings and vectors own.
+        u32 heap_cells = 0;
+        u64 heap_bytes = 0;
+    };
+
+    // Pause times, bucketed by powers of two: bucket 0 holds pauses under 1µs, bucket n pauses
+    // under 2^n µs. The last bucket holds everything longer.
+    class PauseHistogram {
+    public:
+        static constexpr u8 bucket_count = 24;
+
+        void record(std::chrono::nanoseconds pause) {
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(pause).count();
+            u8 bucket = 0;
+            while(us > 0 && bucket < bucket_count - 1) {
+                us >>= 1;
+                bucket += 1;
+            }
+            buckets_[bucket] += 1;
+            total_ += 1;
+        }
+
+        u64 count(u8 bucket) const { return buckets_[bucket]; }
+        u64 total() const { return total_; }
+
+        static std::chrono::microseconds upper_bound(u8 bucket) {
+            return std::chrono::microseconds(u64(1) << bucket);
+        }
+
+        // The upper bound of the bucket that the [p]th percentile (0-1) of pauses falls in.
+        std::chrono::microseconds percentile(double p) const {
+            u64 rank = std::max<u64>(1, p * total_);
+            u64 seen = 0;
+            for(u8 i = 0; i < bucket_count; ++i) {
+                seen += buckets_[i];
+                if(seen >= rank) return upper_bound(i);
+            }
+            return upper_bound(bucket_count - 1);
+        }
+
+        void reset() { *this = PauseHistogram(); }
+
+    private:
+        u64 buckets_[bucket_count] = {};
+        u64 total_ = 0;
+    };
+
+    // Running totals since the collector was created, or since Collector::reset_telemetry().
+    struct GCCounters {
+        u64 minor_collections = 0;
+        u64 full_collections = 0;
+        u64 slices = 0;
+
+        u64 cells_allocated = 0;
+        u64 bytes_allocated = 0;
+        u64 cells_marked = 0;
+        u64 cells_swept = 0;
+        u64 bytes_reclaimed = 0;
+
+        std::chrono::nanoseconds total_pause{0};
+        std::chrono::nanoseconds max_pause{0};
+    };
+}
@@ -8,78 +8,215 @@
 //===--------------------------------------------------------------------------------------------===
 #pragma once
 #include <compass/types.hpp>
+#include <compass/runtime2/shape.hpp>
 #include <apfun/maybe.hpp>
-#include <variant>
+#include <atomic>
+#include <cassert>
+#include <cstring>
 #include <memory>
+#include <type_traits>
+#include <string_view>
 
 /*
 If we want to be able to do proper type checking, we can't just rely on the runtime type
 representation (well, we can, but it's clunky). Sema types to the rescue.
 */
 
+namespace amyinorbit::compass {
+    class Function;
+}
+
 namespace amyinorbit::compass::rt {
 
+    class Collector;
+    struct Cell;
     struct Object;
-    struct Value;
+    struct String;
+    struct List;
 
     constexpr struct nil_t {} nil_tag;
 
     using Ref = Object*;
-    using Array = vector<Value>;
 
+    /*
+    Values are 8 bytes: a type tag in the top 16 bits, and a payload in the low 48 -- either a
+    32-bit number, a pointer to a cell managed by the collector, or a pointer to one of the story's
+    functions (user-space pointers fit in 48 bits on x86-64 and arm64). Copying a value never copies
+    the text or list it points to.
+
+    All-zero bits are nil, so zeroed memory is full of valid values.
+    */
     struct Value {
 
-        enum Type { nil, integer, real, text, object, list };
+        enum Type : u16 { nil, integer, real, text, object, list, function };
+
+        Value() : bits_(0) {}
+        Value(nil_t) : bits_(0) {}
+        Value(i32 value) : bits_(box(integer, u32(value))) {}
+        Value(float value) : bits_(box(real, bits_of(value))) {}
+        Value(String* value) : bits_(box(text, value)) {}
+        Value(Object* value) : bits_(box(object, value)) {}
+        Value(List* value) : bits_(box(list, value)) {}
+        Value(const Function* value) : bits_(box(function, value)) {}
+
+        Type type() const { return static_cast<Type>(bits_ >> 48); }
+
+        template <typename T> bool is() const { return type() == type_of<T>(); }
+
+        template <typename T> T as() const {
+            assert(is<T>() && "invalid value access");
+            if constexpr(std::is_same_v<T, i32>) {
+                return static_cast<i32>(u32(bits_));
+            } else if constexpr(std::is_same_v<T, float>) {
+                float value;
+                u32 bits = u32(bits_);
+                std::memcpy(&value, &bits, sizeof(value));
+                return value;
+            } else {
+                return reinterpret_cast<T>(bits_ & payload_mask);
+            }
+        }
+
+        // The collector-managed cell this value points to, if any. Functions belong to the story,
+        // not to the collector.
+        Cell* cell() const {
+            auto t = type();
+            return t >= text && t <= list ? reinterpret_cast<Cell*>(bits_ & payload_mask) : nullptr;
+        }
+
+        bool operator==(const Value& other) const { return bits_ == other.bits_; }
+        bool operator!=(const Value& other) const { return bits_ != other.bits_; }
+
+    private:
+        static constexpr u64 payload_mask = (u64(1) << 48) - 1;
+
+        template <typename T> static constexpr Type type_of() {
+            if constexpr(std::is_same_v<T, nil_t>) return nil;
+            else if constexpr(std::is_same_v<T, i32>) return integer;
+            else if constexpr(std::is_same_v<T, float>) return real;
+            else if constexpr(std::is_same_v<T, String*>) return text;
+            else if constexpr(std::is_same_v<T, Object*>) return object;
+            else if constexpr(std::is_same_v<T, List*>) return list;
+            else if constexpr(std::is_same_v<T, const Function*>) return function;
+            else static_assert(!sizeof(T), "not a runtime value type");
+        }
+
+        static u32 bits_of(float value) {
+            u32 bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            return bits;
+        }
+
+        static u64 box(Type type, u64 payload) {
+            return (u64(type) << 48) | payload;
+        }
+
+        static u64 box(Type type, const void* ptr) {
+            auto payload = reinterpret_cast<std::uintptr_t>(ptr);
+            assert((payload & ~payload_mask) == 0 && "pointer does not fit in a value");
+            return box(type, u64(payload));
+        }
+
+        u64 bits_;
+    };
+
+    static_assert(sizeof(Value) == 8, "values must fit in a single 64-bit word");
+
+    // Everything the collector manages starts with a cell header. There are no virtual functions:
+    // the collector switches on [kind] instead, so headers stay small.
+    struct Cell {
+        enum class Kind : u8 { object, string, list };
+
+        Cell(Kind kind) : kind(kind) {}
 
-        struct Defer { Type tag; u16 value; };
+        mutable struct {
+            Cell* next = nullptr;
+            std::atomic<bool> stage{false};   // atomic, so parallel markers can claim cells
+            bool old = false;
+            bool remembered = false;
+            bool grey = false;
+        } gc;
 
-        Value() : data_(nil_tag) {}
+        const Kind kind;
+    };
 
-        Type type() const;
+    struct String : Cell {
+        static constexpr Atom no_atom = 0xffffffff;
 
-        template <typename T> Value(const T& val) : data_(val) {}
-        template <typename T> Value& operator=(const T& val) { data_ = val; return *this; }
+        // Strings made while the story runs own their text.
+        String(string text, Atom atom = no_atom)
+            : Cell(Kind::string), owned_(std::move(text)), data(owned_.data(), owned_.size())
+            , atom(atom) {}
 
-        template <typename T> bool is() const { return std::holds_alternative<T>(data_); }
-        template <typename T> const T& as() const { return std::get<T>(data_); }
-        template <typename T> T& as() { return std::get<T>(data_); }
+        // Strings from a loaded story point into its data, which the VM keeps (see Loader).
+        String(std::string_view text, Atom atom) : Cell(Kind::string), data(text), atom(atom) {}
+
+        String(const String&) = delete;
+
+        string text() const { return string(data.data(), data.size()); }
 
     private:
-        std::variant<nil_t, i32, float, string, Ref, Array, Defer> data_;
+        string owned_;
+
+    public:
+        std::string_view data;
+        Atom atom; // strings that come from the story are atoms, and can be compared as such.
+    };
+
+    struct List : Cell {
+        List(vector<Value> items = {}) : Cell(Kind::list), items(std::move(items)) {}
+
+        vector<Value> items;
     };
 
-    struct Object {
-        using Fields = map<string, Value>;
-        Object(const Object* prototype, string name);
+    /*
+    Objects only store the fields they have written. Reads fall through to the prototype chain,
+    and the first write to an inherited field copies it into a slot of the object's own -- so
+    thousands of instances that keep their prototype's defaults don't pay for them.
+    */
+    struct Object : Cell {
+        Object(Collector& collector, const Object* prototype, Atom name);
+        Object(const Object& other);
 
-        bool is_a(const string& name) const;
-        bool is_a(const Object* kind) const;
+        bool is_a(Atom kind) const;
+        bool is_a(const string& kind) const { return is_a(atom(kind)); }
+        bool is_a(const Object* kind) const { return is_a(kind->name()); }
 
         void link() const { is_linked_ = true; }
         bool is_linked() const { return is_linked_; }
 
-        const auto& fields() const { return fields_; }
+        const Shape* shape() const { return shape_; }
+        // The fields this object has written itself. Inherited ones are only in its prototypes.
+        const vector<Value>& slots() const { return slots_; }
 
-        bool has_field(const string& name) const;
-        Value& field(const string& name);
-        const Value& field(const string& name) const;
+        bool has_field(Atom name) const;
+        // Returns the object's own slot for [name], creating it from the inherited value (or nil)
+        // if it doesn't have one yet. Only use it to write a field.
+        Value& field(Atom name);
+        const Value& field(Atom name) const;
 
-        const string& name() const { return name_; }
+        bool has_field(const string& name) const { return has_field(atom(name)); }
+        Value& field(const string& name) { return field(atom(name)); }
+        const Value& field(const string& name) const { return field(atom(name)); }
+
+        // Cached field lookup, for field access instructions. Returns nullptr if there is no
+        // field called [name].
+        const Value* field(Atom name, FieldCache& cache) const;
+
+        Atom name() const { return name_; }
         const Object* prototype() const { return prototype_; }
     private:
         friend class Collector;
 
-        struct Field { string name; Value value; };
-
-        mutable struct {
-            Object* next = nullptr;
-            bool stage = false;
-        } gc;
+        const Value* find(Atom name) const;
+        const Shape* heir_shape() const;
 
         const Object* prototype_;
-        string name_;
-        // vector<Field> fields_;
-        Fields fields_;
+        Atom name_;
+        const Shape* shape_;
+        vector<Value> slots_;
+        mutable const Shape* heir_shape_ = nullptr; // Root shape of the objects built from this one.
+        Collector* collector_; // For the write barrier, and the shape tree.
         mutable bool is_linked_ = true;
     };
 }
@@ -11,48 +11,95 @@
 #include <compass/runtime2/type.hpp>
 #include <compass/runtime2/collector.hpp>
 #include <compass/runtime2/bin_io.hpp>
+#include <compass/runtime2/function.hpp>
+#include <compass/runtime2/memory.hpp>
 #include <iostream>
+#include <memory>
 #include <cassert>
+#include <variant>
 
 namespace amyinorbit::compass {
 
+    /*
+    The loader decodes a story straight out of memory. A story loaded from a file path is mapped,
+    so the OS only reads the pages that get used; one read from a stream is copied into a buffer
+    first. Either way, nothing is copied out of that data: strings are views into it, and
+    functions point at their code in it and are only decoded when they are first called.
+
+    The data is shared: the loader keeps it for its functions, and VM::load() keeps it for the
+    strings, which live in the collector.
+    */
     class Loader {
     public:
-        Loader(rt::Collector& collector, std::istream& in)
-            : collector_(collector), reader_(in) {}
+        Loader(rt::Collector& collector, std::istream& in);
+        Loader(rt::Collector& collector, const char* path);
 
+        // The collector is paused while loading: nothing the story allocates is reachable from a
+        // root until the caller picks up constants() and objects().
         void load();
 
+        const vector<rt::Value>& constants() const { return constants_; }
+        const vector<rt::Object*>& objects() const { return linked_; }
+
+        const Function* function(const string& name) const {
+            return function_names_.count(name) ? function_names_.at(name) : nullptr;
+        }
+
+        const vector<std::unique_ptr<Function>>& functions() const { return functions_; }
+
+        std::shared_ptr<const MappedFile> data() const { return file_; }
+
     private:
+        // References to constants and objects can point forward in the story file. Until link()
+        // runs, they are stored as the type and index of what they point to.
+        struct Deferred {
+            rt::Value::Type type;
+            u16 index;
+        };
+
+        using Unresolved = std::variant<rt::Value, Deferred>;
+        using Fields = map<rt::Atom, Unresolved>;
+
+        struct UnlinkedConstant {
+            u16 index;
+            Deferred value;
+        };
+
+        struct UnlinkedList {
+            rt::List* list;
+            vector<Unresolved> items;
+        };
+
         struct Unlinked {
-            Unlinked(u16 prototype, u16 name, rt::Object::Fields&& fields)
+            Unlinked(u16 prototype, u16 name, Fields&& fields)
                 : linked(nullptr), prototype(prototype), name(name), fields(std::move(fields)) {}
 
             rt::Object* linked = nullptr;
 
             u16 prototype;
             u16 name;
-            rt::Object::Fields fields;
+            Fields fields;
         };
 
-        string name(const rt::Value& val) const;
+        rt::Atom name(const Unresolved& val) const;
 
         bool signature();
         void object();
+        void function();
         void constant();
-        rt::Value value();
+        Unresolved value();
 
         void utf8();
         void list();
 
         void link();
         rt::Object* link_object(u16 idx);
-        rt::Value link_value(const rt::Value& v);
+        rt::Value link_value(const Unresolved& v);
 
-        const rt::Value& constant(u16 idx, rt::Value::Type type);
+        const rt::Value& constant(u16 idx, rt::Value::Type type) const;
 
         template <typename T>
-        const T& constant(u16 idx) {
+        T constant(u16 idx) const {
             assert(idx < constants_.size());
             const auto& v = constants_[idx];
             assert(v.is<T>());
@@ -60,9 +107,15 @@ namespace amyinorbit::compass {
         }
 
         vector<Unlinked> objects_;
+        vector<UnlinkedList> lists_;
+        vector<UnlinkedConstant> deferred_constants_;
+        vector<rt::Object*> linked_;
         vector<rt::Value> constants_;
+        vector<std::unique_ptr<Function>> functions_; // in story order, which ref_function uses
+        map<string, const Function*> function_names_;
 
         rt::Collector& collector_;
-        BinaryReader reader_;
+        std::shared_ptr<const MappedFile> file_;
+        BufferReader reader_;
     };
 }
@@ -7,35 +7,95 @@
 // =^•.•^=
 //===--------------------------------------------------------------------------------------------===
 #pragma once
+#include <algorithm>
 #include <compass/runtime2/bytecode.hpp>
+#include <compass/runtime2/collector.hpp>
+#include <compass/runtime2/function.hpp>
 #include <compass/runtime2/memory.hpp>
+#include <compass/runtime2/type.hpp>
+#include <iostream>
 
 namespace amyinorbit::compass {
+    class Loader;
 
+    // Every stack cell holds one rt::Value. Strings, lists and objects live in the collector, so
+    // the stack only ever holds pointers to them.
+    //
+    // Pushes and pops are not bounds-checked: the stack lives in a region with a guard page at
+    // each end, and the VM turns a fault in either one into a stack overflow or underflow error.
     class Stack {
     public:
         using size_type = Memory::size_type;
-        Stack(size_type capacity) : memory_(capacity), top_(0) {}
+        static constexpr size_type cell_size = sizeof(rt::Value);
 
-        template <typename T, std::enable_if_t<sizeof(T) <= 4>* = nullptr>
-        void push(const T& value) {
-            memory_.write(top_, value);
-            top_ += 4;
+        Stack(size_type capacity, Memory::Paging paging = Memory::Paging::normal)
+            : region_(capacity, paging)
+            , base_(reinterpret_cast<rt::Value*>(region_.begin()))
+            , top_(base_) {}
+
+        void push(const rt::Value& value) {
+            *top_++ = value;
+        }
+
+        rt::Value pop() {
+            return *--top_;
+        }
+
+        // Pops a value nobody needs. The read is still done, so an underflow hits the guard page.
+        void drop() {
+            --top_;
+            (void)*reinterpret_cast<const volatile u8*>(top_);
+        }
+
+        const rt::Value& peek() const {
+            return top_[-1];
+        }
+
+        // Slot-indexed access, used for the locals window of the running function.
+        rt::Value& at(size_type slot) {
+            return base_[slot];
+        }
+
+        const rt::Value& at(size_type slot) const {
+            return base_[slot];
+        }
+
+        void reserve(size_type slots) {
+            while(slots--) push(rt::nil_tag);
         }
 
-        template <typename T, std::enable_if_t<sizeof(T) <= 4>* = nullptr>
-        T pop() {
-            top_ -= 4;
-            return memory_.read<T>(top_);
+        size_type size() const { return top_ - base_; }
+        void resize(size_type slots) { top_ = base_ + slots; }
+
+        // Whether [slots] more values fit on the stack.
+        bool has_room(size_type slots) const {
+            return size_type(reinterpret_cast<const rt::Value*>(region_.end()) - top_) >= slots;
         }
 
-        template <typename T, std::enable_if_t<sizeof(T) <= 4>* = nullptr>
-        const T& peek() const {
-            return memory_.read<T>(top_ - 1);
+        const GuardedRegion& region() const { return region_; }
+
+    private:
+        GuardedRegion region_;
+        rt::Value* base_;
+        rt::Value* top_;
+    };
+
+    // Counts how often each opcode follows another. Built with COMPASS_PROFILE_DISPATCH, the
+    // interpreter records every dispatch here; the most frequent pairs are the ones worth turning
+    // into superinstructions (see compiler/fusion.hpp).
+    class DispatchProfile {
+    public:
+        void record(u16 op) {
+            pairs_[last_ * opcode_count + op] += 1;
+            last_ = op;
         }
+
+        void reset();
+        void dump(std::ostream& out, u32 count = 16) const;
+
     private:
-        Memory memory_;
-        size_type top_;
+        u16 last_ = 0;
+        vector<u64> pairs_ = vector<u64>(opcode_count * opcode_count, 0);
     };
 
     /*
@@ -54,18 +114,112 @@ namespace amyinorbit::compass {
 
     */
 
+    /*
+    Calls don't copy anything: the caller pushes the arguments and then the function, and `call n`
+    makes the [n] values under the function the first locals of the callee. `resv` then reserves
+    the rest of its locals above them. `ret` pops the return value, drops the callee's window, and
+    pushes the value back for the caller.
+
+    The caller's function, instruction pointer and locals base are saved in a frame record. The
+    records live in one array allocated with the VM, so calls never allocate.
+    */
+    struct Frame {
+        const Function* function;
+        const Function::Instruction* ip; // in the function's decoded image
+        Stack::size_type base;
+    };
+
     class VM {
     public:
         static constexpr u32 kb = 1024;
         static constexpr u32 mb = 1024 * kb;
+        static constexpr u32 max_globals = 1 << 16;
+        static constexpr u32 max_frames = 1024;
+
+        enum class Result { ok, error };
 
         VM();
+        VM(std::istream& in, std::ostream& out);
+
+        // Copies the story's constant pool into the constants region, and keeps its objects and
+        // data alive. Functions are decoded when they are first called. [story] must have been
+        // loaded with this machine's collector(), and still owns the functions.
+        void load(const Loader& story);
+
+        // Runs [fn] until it halts or returns, decoding it first if it has never run. Anything left
+        // on the stack (like a return value) stays there for the host to pick up. If the story
+        // overflows or underflows the stack, the run ends with an error and the stack is cut back
+        // to where it was.
+        Result run(const Function& fn);
+
+        Stack& stack() { return stack_; }
+        rt::Collector& collector() { return collector_; }
+        const DispatchProfile& profile() const { return profile_; }
+        const string& error() const { return error_; }
+
+        // The text iowrite prints for [value].
+        string text(const rt::Value& value) const;
 
     private:
+        // How a function stopped running.
+        enum class Exit : u8 { ret, halt, error };
+
+        rt::Value& constant(u16 idx) {
+            return *constants_.ptr<rt::Value>(constants_base_ + idx * Stack::cell_size);
+        }
+
+        rt::Value& global(u32 idx) {
+            return *heap_.ptr<rt::Value>(globals_base_ + idx * Stack::cell_size);
+        }
+
+        // Globals aren't cells, so there is no write barrier on them. Instead, the ones given a
+        // young cell are noted down: they are the only globals a minor collection has to scan.
+        void store_global(u32 idx, const rt::Value& value) {
+            global(idx) = value;
+            globals_count_ = std::max(globals_count_, idx + 1);
 
-        Stack stack_{10 * mb};
+            auto cell = value.cell();
+            if(!cell || cell->gc.old || young_global_[idx]) return;
+            young_global_[idx] = true;
+            young_globals_.push_back(idx);
+        }
+
+        // Returns false, with the error set, if a jump doesn't land on an instruction.
+        bool decode(const Function& fn);
+
+        Exit execute(const Function& fn, Stack::size_type base);
+
+        void mark_roots(rt::Collector& collector);
+        Exit runtime_error(const string& message);
+
+        // The loaded story's strings point into its data, so it goes after the collector.
+        std::shared_ptr<const MappedFile> story_data_;
+
+        // Declared before the regions so that it is destroyed after them: they can point into it.
+        rt::Collector collector_;
+
+        // These are reservations, not allocations: only the pages a story touches are committed.
+        Stack stack_;
         Memory constants_{10 * mb};
         Memory heap_{10 * mb};
-    };
 
+        Memory::size_type constants_base_ = 0;
+        Memory::size_type globals_base_ = 0;
+        u16 constants_count_ = 0;
+        u32 globals_count_ = 0; // one past the highest global written, so marking can stop there.
+        vector<u32> young_globals_;
+        vector<bool> young_global_ = vector<bool>(max_globals, false);
+        bool story_young_ = false; // until a minor collection promotes the story's cells
+
+        vector<rt::Object*> objects_;
+        vector<Frame> frames_ = vector<Frame>(max_frames);
+
+        std::istream& in_;
+        std::ostream& out_;
+        u16 device_ = 0;
+        u16 style_ = 0;
+        string error_;
+
+        DispatchProfile profile_;
+    };
 }
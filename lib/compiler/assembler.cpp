@@ -7,6 +7,7 @@
 // =^•.•^=
 //===--------------------------------------------------------------------------------------------===
 #include <compass/compiler/assembler.hpp>
+#include <compass/runtime2/bytecode.hpp>
 #include <apfun/maybe.hpp>
 #include "instr_data.inc"
 
@@ -63,6 +64,7 @@ namespace amyinorbit::compass {
         expect(Token::string_literal);
         expect(Token::brace_l);
 
+        code_.clear();
         for(;;) {
             if(is(Token::identifier)) eat(); // TODO: replace with label();
             if(is(Token::instruction)) instruction();
@@ -70,14 +72,21 @@ namespace amyinorbit::compass {
         }
 
         expect(Token::brace_r);
+        functions_[name] = std::move(code_);
     }
 
     void Assembler::instruction() {
         auto mnem = text();
         expect(Token::instruction, "invalid source (expected an instruction mnemonic)");
         std::cout << "instr: " << mnem;
-        if(!is(Token::new_line) && !is(Token::end)) {
-            operand(instruction_data.at(mnem).op);
+
+        // Instructions take one operand per varint, or a single fixed-size one.
+        const auto& data = instruction_data.at(mnem);
+        code_.push_back(static_cast<u8>(data.op));
+        if(data.varints) {
+            for(i8 i = 0; i < data.varints; ++i) operand(0);
+        } else if(data.operands) {
+            operand(data.operands);
         }
         std::cout << "\n";
     }
@@ -106,9 +115,15 @@ namespace amyinorbit::compass {
         return Value(nil_tag);
     }
 
-    void Assembler::operand(Opcode inst) {
-        literal();
-        // else if(matc)
+    void Assembler::operand(i8 size) {
+        u32 value = std::atoi(text().data());
+        expect(Token::int_literal, "expected an integer operand");
+
+        if(!size) {
+            write_varint(code_, value);
+            return;
+        }
+        for(i8 i = 0; i < size; ++i) code_.push_back((value >> (8 * i)) & 0xff);
     }
 
     bool Assembler::match(Token::Kind kind) {
@@ -240,6 +255,9 @@ namespace amyinorbit::compass {
                     if(c.is_identifier_head()) {
                         return lex_ident();
                     }
+                    if(is_digit(c) || c.value == '-') {
+                        return lex_number();
+                    }
                     std::cout << "invalid: " << c << "\n";
                     return make_token(Token::invalid, "invalid character in source");
             }
@@ -7,6 +7,9 @@
 // =^•.•^=
 //===--------------------------------------------------------------------------------------------===
 #include <compass/compiler/codegen.hpp>
+#include <compass/compiler/fusion.hpp>
+#include <compass/compiler/inst_checker.hpp>
+#include <compass/compiler/peephole.hpp>
 #include <cassert>
 #include <string>
 
@@ -28,8 +31,13 @@ namespace amyinorbit::compass {
         return idx;
     }
 
+    u16 CodeGen::add_function(const string& name, const Function* fn) {
+        functions_.emplace_back(name, fn);
+        return (u16)functions_.size() - 1;
+    }
+
     void CodeGen::write(std::ostream& out) {
-        Writer writer(out);
+        Writer writer;
 
         writer.write("CSF2", 4);
 
@@ -53,6 +61,13 @@ namespace amyinorbit::compass {
         u32 globals_offset = (u32)writer.size();
         writer.write<u16>(0);
 
+        // Functions
+        u32 functions_offset = (u32)writer.size();
+        writer.write<u16>(functions_.size());
+        for(const auto& [name, fn]: functions_) {
+            write_function(writer, name, fn);
+        }
+
         // Constant pool
         u32 constants_offset = (u32)writer.size();
         writer.write<u16>(constants_.size());
@@ -60,10 +75,15 @@ namespace amyinorbit::compass {
             write_constant(writer, val);
         }
 
+        writer.go(4);
+        writer.write<u32>(functions_offset);
+
         writer.go(4 + 4 * sizeof(u32));
         writer.write<u32>(heap_offset);
         writer.write<u32>(globals_offset);
         writer.write<u32>(constants_offset);
+
+        BinaryWriter(out).write(reinterpret_cast<const char*>(writer.data()), writer.size());
     }
 
     /*
@@ -93,6 +113,34 @@ namespace amyinorbit::compass {
         }
     }
 
+    /*
+    ### Function
+
+        u1          tag         0xA3
+        u2          name        reference to UTF8 string
+        u2          max_stack   deepest the function takes the stack, above its arguments
+        u4          length      number of code bytes
+        u1[]        code        bytecode
+    */
+    void CodeGen::write_function(Writer& out, const string& name, const Function* fn) {
+        // Superinstructions are picked last, once the bytecode won't change anymore.
+        auto code = fuse_superinstructions(optimise_bytecode(fn->code(), *this));
+
+        // The VM trusts the code it loads, so anything that doesn't verify is a compiler bug.
+        InstructionChecker checker(code);
+        if(!checker.check()) {
+            std::cerr << "fatal error: invalid bytecode in '" << name << "' at "
+                      << checker.error_offset() << ": " << checker.error() << "\n";
+            abort();
+        }
+
+        out.write(Tag::data_function);
+        out.write<u16>(add_constant(Value(name)));
+        out.write<u16>(checker.max_stack());
+        out.write<u32>(code.size());
+        out.write(reinterpret_cast<const char*>(code.data()), code.size());
+    }
+
     void CodeGen::write_constant(Writer& out, const Value& val) {
         switch(val.type()) {
 
@@ -158,6 +206,12 @@ namespace amyinorbit::compass {
                 out.write<u16>(add_constant(val));
                 out.write<u16>(0);
                 break;
+
+            case Value::function:
+                out.write(Tag::ref_function);
+                out.write<u16>(val.as<FunctionRef>().index);
+                out.write<u16>(0);
+                break;
         }
     }
 }
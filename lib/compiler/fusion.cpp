@@ -0,0 +1,74 @@
+//===--------------------------------------------------------------------------------------------===
+// fusion.cpp - Superinstruction fusion pass
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include <compass/compiler/fusion.hpp>
+#include <compass/compiler/instruction_list.hpp>
+#include <cassert>
+
+namespace amyinorbit::compass {
+
+    struct Fusion {
+        Bytecode fused;
+        vector<Bytecode> sequence;
+    };
+
+    // The order was seeded by hand, not measured. When two candidates overlap, the first one in the
+    // list wins. To rank it properly, build with COMPASS_PROFILE_DISPATCH, run some stories, and
+    // read the most frequent pairs from DispatchProfile::dump() (see runtime2/vm.hpp).
+    static const Fusion fusions[] = {
+        {Bytecode::writec, {Bytecode::loadc, Bytecode::iowrite}},
+        {Bytecode::cmpijz, {Bytecode::cmpi, Bytecode::jmpz}},
+        {Bytecode::addll, {Bytecode::loadl, Bytecode::loadl, Bytecode::addi}},
+    };
+
+    static bool matches(const InstructionList& code, const vector<bool>& targets, u32 at,
+                        const Fusion& fusion) {
+        if(at + fusion.sequence.size() > code.size()) return false;
+
+        for(u32 i = 0; i < fusion.sequence.size(); ++i) {
+            if(code[at + i].op != fusion.sequence[i]) return false;
+            if(i > 0 && targets[at + i]) return false;
+        }
+        return true;
+    }
+
+    static Instruction fuse(const Instruction* seq, Bytecode fused) {
+        switch(fused) {
+        // addll's operand is both local indices, one byte each.
+        case Bytecode::addll: return {fused, seq[0].operand | (seq[1].operand << 8)};
+        case Bytecode::cmpijz: return {fused, seq[1].operand};
+        case Bytecode::writec: return {fused, seq[0].operand};
+        default: break;
+        }
+        assert(false && "not a superinstruction");
+        return seq[0];
+    }
+
+    vector<u8> fuse_superinstructions(const vector<u8>& code) {
+        auto instructions = decode(code);
+        auto targets = jump_targets(instructions);
+        vector<bool> dead(instructions.size(), false);
+
+        u32 i = 0;
+        while(i < instructions.size()) {
+            u32 length = 1;
+            for(const auto& fusion: fusions) {
+                if(!matches(instructions, targets, i, fusion)) continue;
+
+                instructions[i] = fuse(&instructions[i], fusion.fused);
+                length = fusion.sequence.size();
+                for(u32 j = 1; j < length; ++j) dead[i + j] = true;
+                break;
+            }
+            i += length;
+        }
+
+        compact(instructions, dead);
+        return encode(instructions);
+    }
+}
@@ -0,0 +1,162 @@
+//===--------------------------------------------------------------------------------------------===
+// inst_checker.cpp - Static verifier for function bytecode
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include <compass/compiler/inst_checker.hpp>
+#include <compass/runtime2/vm.hpp>
+#include <algorithm>
+
+namespace amyinorbit::compass {
+
+    // How many values an instruction needs on the stack before it runs. bytecode.def only has the
+    // net effect, which can't tell a loada on one value from a dup.
+    static i32 inputs(Bytecode op, u32 operand) {
+        switch(op) {
+        case Bytecode::loadf:
+        case Bytecode::storeg:
+        case Bytecode::storel:
+        case Bytecode::drop:
+        case Bytecode::dup:
+        case Bytecode::jmpz:
+        case Bytecode::rjmpz:
+        case Bytecode::jmpnz:
+        case Bytecode::rjmpnz:
+        case Bytecode::ret:
+        case Bytecode::iowrite:
+        case Bytecode::i2s:
+        case Bytecode::i2f:
+        case Bytecode::f2s:
+        case Bytecode::f2i:
+            return 1;
+
+        case Bytecode::loada:
+        case Bytecode::addi:
+        case Bytecode::subi:
+        case Bytecode::muli:
+        case Bytecode::divi:
+        case Bytecode::cmpi:
+        case Bytecode::addf:
+        case Bytecode::subf:
+        case Bytecode::mulf:
+        case Bytecode::divf:
+        case Bytecode::cmpf:
+        case Bytecode::cmps:
+        case Bytecode::cmpijz:
+            return 2;
+
+        case Bytecode::storea:
+            return 3;
+
+        case Bytecode::call:
+            return operand + 1; // the arguments, then the function
+        default:
+            return 0;
+        }
+    }
+
+    static i32 effect(Bytecode op, u32 operand) {
+        switch(op) {
+        case Bytecode::resv: return operand;
+        // The result replaces the function and its arguments.
+        case Bytecode::call: return -i32(operand);
+        default: return info(op).stack;
+        }
+    }
+
+    bool InstructionChecker::fail(u32 offset, const string& message) {
+        error_ = message;
+        error_offset_ = offset;
+        return false;
+    }
+
+    bool InstructionChecker::reach(u32 from, u32 offset, i32 depth, vector<u32>& pending) {
+        if(offset >= code_.size()) return fail(from, "control runs past the end of the function");
+        if(!starts_[offset]) return fail(from, "jump into the middle of an instruction");
+
+        if(depth_[offset] == unvisited) {
+            depth_[offset] = depth;
+            pending.push_back(offset);
+            return true;
+        }
+        if(depth_[offset] != depth) {
+            return fail(from, "paths reach an instruction with different stack depths ("
+                        + std::to_string(depth_[offset]) + " and " + std::to_string(depth) + ")");
+        }
+        return true;
+    }
+
+    bool InstructionChecker::check() {
+        error_.clear();
+        max_stack_ = 0;
+        depth_.assign(code_.size(), unvisited);
+        starts_.assign(code_.size(), false);
+
+        if(code_.empty()) return fail(0, "empty function");
+        for(u32 offset = 0; offset < code_.size(); ) {
+            if(code_[offset] >= opcode_count) return fail(offset, "invalid opcode");
+            auto op = static_cast<Bytecode>(code_[offset]);
+            if(is_quickened(op)) return fail(offset, "quickened instruction outside the VM");
+            starts_[offset] = true;
+
+            // Varints must end before the code does, and hold no more than a 16-bit index.
+            u32 size = 1 + info(op).operands;
+            for(u8 i = 0; i < info(op).varints; ++i) {
+                u32 value = 0;
+                for(u8 shift = 0;; shift += 7) {
+                    if(offset + size >= code_.size()) return fail(offset, "truncated operand");
+                    u8 byte = code_[offset + size++];
+                    value |= u32(byte & 0x7f) << shift;
+                    if(!(byte & 0x80)) break;
+                    if(shift + 7 >= 7 * max_varint_size) return fail(offset, "varint too long");
+                }
+                if(value > 0xffff) return fail(offset, "varint operand out of range");
+            }
+            if(offset + size > code_.size()) return fail(offset, "truncated operand");
+            offset += size;
+        }
+
+        vector<u32> pending;
+        reach(0, 0, 0, pending);
+
+        while(pending.size()) {
+            u32 offset = pending.back();
+            pending.pop_back();
+
+            // Every instruction was checked to fit when it was found, so it can be read blindly.
+            const u8* ip = code_.data() + offset;
+            auto op = static_cast<Bytecode>(*ip++);
+            u32 operand = read_operand(op, ip);
+            u32 next = ip - code_.data();
+            i32 depth = depth_[offset];
+
+            if(depth < inputs(op, operand)) {
+                return fail(offset, string(info(op).mnemonic) + ": stack underflow");
+            }
+            if((op == Bytecode::storeg || op == Bytecode::loadg) && operand >= VM::max_globals) {
+                return fail(offset, string(info(op).mnemonic) + ": invalid global index");
+            }
+
+            depth += effect(op, operand);
+            if(depth > 0xffff) return fail(offset, "function needs too much stack space");
+            max_stack_ = std::max(max_stack_, u16(depth));
+
+            if(op == Bytecode::ret || op == Bytecode::halt) continue;
+
+            if(is_jump(op)) {
+                u32 at = offset + 1;
+                if(is_backward_jump(op) && operand > at) {
+                    return fail(offset, "jump before the start of the function");
+                }
+                u32 target = is_backward_jump(op) ? at - operand : at + operand;
+                if(!reach(offset, target, depth, pending)) return false;
+                if(op == Bytecode::jmp || op == Bytecode::rjmp) continue;
+            }
+            if(!reach(offset, next, depth, pending)) return false;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,111 @@
+//===--------------------------------------------------------------------------------------------===
+// instruction_list.cpp - Bytecode decoding and relocation
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include <compass/compiler/instruction_list.hpp>
+#include <cassert>
+
+namespace amyinorbit::compass {
+
+    InstructionList decode(const vector<u8>& code) {
+        InstructionList instructions;
+        vector<i32> index(code.size() + 1, -1);
+        vector<u32> operand_at;
+
+        const u8* ip = code.data();
+        const u8* end = ip + code.size();
+        while(ip < end) {
+            Instruction inst{static_cast<Bytecode>(*ip)};
+            assert(static_cast<u16>(inst.op) < opcode_count && "invalid opcode");
+
+            index[ip - code.data()] = instructions.size();
+            operand_at.push_back(ip + 1 - code.data());
+
+            ip += 1;
+            inst.operand = read_operand(inst.op, ip);
+            assert(ip <= end && "truncated instruction");
+            instructions.push_back(inst);
+        }
+        index[code.size()] = instructions.size();
+
+        for(u32 i = 0; i < instructions.size(); ++i) {
+            auto& inst = instructions[i];
+            if(!is_jump(inst.op)) continue;
+
+            u32 target = is_backward_jump(inst.op)
+                ? operand_at[i] - inst.operand
+                : operand_at[i] + inst.operand;
+            assert(target < index.size() && index[target] >= 0 && "jump between instructions");
+            inst.operand = index[target];
+        }
+        return instructions;
+    }
+
+    vector<u8> encode(const InstructionList& instructions) {
+        // Jump operands have a fixed size, so every offset is known before anything is written.
+        vector<u32> offsets;
+        offsets.reserve(instructions.size() + 1);
+
+        u32 offset = 0;
+        for(const auto& inst: instructions) {
+            offsets.push_back(offset);
+            offset += encoded_size(inst.op, inst.operand);
+        }
+        offsets.push_back(offset);
+
+        vector<u8> code;
+        code.reserve(offset);
+
+        for(u32 i = 0; i < instructions.size(); ++i) {
+            const auto& inst = instructions[i];
+            code.push_back(static_cast<u8>(inst.op));
+
+            u32 operand = inst.operand;
+            if(is_jump(inst.op)) {
+                u32 at = offsets[i] + 1;
+                u32 target = offsets[inst.operand];
+                operand = is_backward_jump(inst.op) ? at - target : target - at;
+                assert(operand <= 0xffff && "jump is too far");
+            }
+            write_operand(code, inst.op, operand);
+        }
+        return code;
+    }
+
+    vector<bool> jump_targets(const InstructionList& instructions) {
+        vector<bool> targets(instructions.size() + 1, false);
+        for(const auto& inst: instructions) {
+            if(is_jump(inst.op)) targets[inst.operand] = true;
+        }
+        return targets;
+    }
+
+    void compact(InstructionList& instructions, const vector<bool>& dead) {
+        assert(dead.size() == instructions.size());
+
+        // Work backwards so that a removed instruction can point at the next one that survives.
+        vector<u32> remap(instructions.size() + 1);
+        u32 survivors = 0;
+        for(u32 i = 0; i < instructions.size(); ++i) {
+            if(!dead[i]) survivors += 1;
+        }
+
+        remap[instructions.size()] = survivors;
+        for(u32 i = instructions.size(); i-- > 0;) {
+            remap[i] = dead[i] ? remap[i + 1] : --survivors;
+        }
+
+        u32 out = 0;
+        for(u32 i = 0; i < instructions.size(); ++i) {
+            if(dead[i]) continue;
+            auto inst = instructions[i];
+            if(is_jump(inst.op)) inst.operand = remap[inst.operand];
+            instructions[out++] = inst;
+        }
+        instructions.resize(out);
+    }
+}
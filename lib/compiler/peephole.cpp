@@ -0,0 +1,195 @@
+//===--------------------------------------------------------------------------------------------===
+// peephole.cpp - Peephole and jump-threading optimiser
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include <compass/compiler/peephole.hpp>
+#include <compass/compiler/codegen.hpp>
+#include <compass/compiler/instruction_list.hpp>
+#include <cassert>
+
+namespace amyinorbit::compass {
+
+    // Everything a pass needs: the code, which instructions are jump targets, and which ones are
+    // to be removed once the pass is over.
+    struct Peephole {
+        InstructionList& code;
+        CodeGen& codegen;
+        vector<bool> targets;
+        vector<bool> dead;
+
+        // Whether instructions [at] to [at + count) exist, and only the first one can be jumped to.
+        bool straight(u32 at, u32 count) const {
+            if(at + count > code.size()) return false;
+            for(u32 i = 1; i < count; ++i) {
+                if(targets[at + i] || dead[at + i]) return false;
+            }
+            return !dead[at];
+        }
+
+        bool is(u32 at, Bytecode op) const { return code[at].op == op; }
+
+        bool is_int_constant(u32 at) const {
+            return is(at, Bytecode::loadc) && codegen.constant(code[at].operand).is<i32>();
+        }
+
+        i32 int_constant(u32 at) const { return codegen.constant(code[at].operand).as<i32>(); }
+
+        void kill(u32 at, u32 count) {
+            for(u32 i = 0; i < count; ++i) dead[at + i] = true;
+        }
+    };
+
+    // MARK: - Peephole patterns
+
+    static bool fold_constants(Peephole& p, u32 at) {
+        if(!p.straight(at, 3) || !p.is_int_constant(at) || !p.is_int_constant(at + 1)) return false;
+
+        // Wraps around like the VM's arithmetic does, without the undefined behaviour.
+        u32 a = p.int_constant(at);
+        u32 b = p.int_constant(at + 1);
+        u32 result = 0;
+        switch(p.code[at + 2].op) {
+        case Bytecode::addi: result = a + b; break;
+        case Bytecode::muli: result = a * b; break;
+        default: return false;
+        }
+
+        p.code[at].operand = p.codegen.add_constant(Value(i32(result)));
+        p.kill(at + 1, 2);
+        return true;
+    }
+
+    static bool remove_pairs(Peephole& p, u32 at) {
+        if(!p.straight(at, 2)) return false;
+        const auto& first = p.code[at];
+        const auto& second = p.code[at + 1];
+
+        bool useless = (first.op == Bytecode::dup && second.op == Bytecode::drop)
+            || (first.op == Bytecode::loadl && second.op == Bytecode::storel
+                && first.operand == second.operand);
+        if(useless) p.kill(at, 2);
+        return useless;
+    }
+
+    // MARK: - Jumps
+
+    static bool is_unconditional(Bytecode op) {
+        return op == Bytecode::jmp || op == Bytecode::rjmp;
+    }
+
+    static bool is_zero_test(Bytecode op) {
+        return op == Bytecode::jmpz || op == Bytecode::rjmpz;
+    }
+
+    static bool is_not_zero_test(Bytecode op) {
+        return op == Bytecode::jmpnz || op == Bytecode::rjmpnz;
+    }
+
+    // jmpz and jmpnz only peek at the top of the stack, so a jump that lands on another one with
+    // the same condition knows it will be taken too.
+    static bool same_condition(Bytecode a, Bytecode b) {
+        return (is_zero_test(a) && is_zero_test(b)) || (is_not_zero_test(a) && is_not_zero_test(b));
+    }
+
+    // Returns the jump with the same condition as [op], in the direction of [target] from [at].
+    // cmpijz only goes forward, so it has no backward form.
+    static bool orient(Bytecode& op, u32 at, u32 target) {
+        bool backward = target <= at;
+        switch(op) {
+        case Bytecode::jmp: case Bytecode::rjmp:
+            op = backward ? Bytecode::rjmp : Bytecode::jmp;
+            return true;
+        case Bytecode::jmpz: case Bytecode::rjmpz:
+            op = backward ? Bytecode::rjmpz : Bytecode::jmpz;
+            return true;
+        case Bytecode::jmpnz: case Bytecode::rjmpnz:
+            op = backward ? Bytecode::rjmpnz : Bytecode::jmpnz;
+            return true;
+        default:
+            return !backward;
+        }
+    }
+
+    static bool thread_jump(Peephole& p, u32 at) {
+        auto& inst = p.code[at];
+        if(p.dead[at] || !is_jump(inst.op)) return false;
+
+        // A jump to the next instruction does nothing, unless it pops something (cmpijz).
+        bool keeps_stack = is_unconditional(inst.op) || is_zero_test(inst.op)
+            || is_not_zero_test(inst.op);
+        if(inst.operand == at + 1 && keeps_stack) {
+            p.kill(at, 1);
+            return true;
+        }
+
+        // Follow the chain, but not round a loop made only of jumps.
+        u32 target = inst.operand;
+        for(u32 hops = 0; hops < p.code.size() && target < p.code.size(); ++hops) {
+            const auto& next = p.code[target];
+            if(!is_unconditional(next.op) && !same_condition(inst.op, next.op)) break;
+            if(next.operand == target) break;
+            target = next.operand;
+        }
+        if(target == inst.operand) return false;
+
+        auto op = inst.op;
+        if(!orient(op, at, target)) return false;
+        inst = {op, target};
+        return true;
+    }
+
+    // Marks every instruction that no path from the start of the function reaches.
+    static bool remove_unreachable(Peephole& p) {
+        vector<bool> reached(p.code.size(), false);
+        vector<u32> pending{0};
+
+        while(pending.size()) {
+            u32 at = pending.back();
+            pending.pop_back();
+            if(at >= p.code.size() || reached[at]) continue;
+            reached[at] = true;
+
+            const auto& inst = p.code[at];
+            if(is_jump(inst.op)) pending.push_back(inst.operand);
+            if(is_unconditional(inst.op) || inst.op == Bytecode::ret || inst.op == Bytecode::halt)
+                continue;
+            pending.push_back(at + 1);
+        }
+
+        bool changed = false;
+        for(u32 i = 0; i < p.code.size(); ++i) {
+            if(reached[i] || p.dead[i]) continue;
+            p.dead[i] = true;
+            changed = true;
+        }
+        return changed;
+    }
+
+    // MARK: - Driver
+
+    vector<u8> optimise_bytecode(const vector<u8>& code, CodeGen& codegen) {
+        auto instructions = decode(code);
+
+        // Each change can open up another one (a removed pair brings two constants together, a
+        // threaded jump leaves code unreachable), so go round until nothing changes.
+        bool changed = true;
+        while(changed && instructions.size()) {
+            Peephole p{instructions, codegen, jump_targets(instructions),
+                       vector<bool>(instructions.size(), false)};
+
+            changed = remove_unreachable(p);
+            for(u32 i = 0; i < instructions.size(); ++i) {
+                if(p.dead[i]) continue;
+                changed |= thread_jump(p, i);
+                changed |= fold_constants(p, i);
+                changed |= remove_pairs(p, i);
+            }
+            compact(instructions, p.dead);
+        }
+        return encode(instructions);
+    }
+}
@@ -129,6 +129,10 @@ namespace amyinorbit::compass::sema {
             print_index_(val.as<Ref>(), depth+1);
             break;
 
+        case Value::function:
+            std::cout << "fn:" << val.as<FunctionRef>().index;
+            break;
+
         }
     }
 
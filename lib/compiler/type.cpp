@@ -21,6 +21,8 @@ namespace amyinorbit::compass {
             case Value::property: return left.as<Property>().value == right.as<Property>().value;
             case Value::object: return left.as<Object*>() == right.as<Object*>();
             case Value::list: return left.as<Array>() == right.as<Array>();
+            case Value::function:
+                return left.as<FunctionRef>().index == right.as<FunctionRef>().index;
         }
         return false;
     }
@@ -109,6 +111,7 @@ namespace amyinorbit::compass {
                 }
                 out << "]";
                 break;
+            case Value::function: out << "fn/" << v.as<FunctionRef>().index; break;
         }
         return out;
     }
@@ -134,6 +137,7 @@ namespace amyinorbit::compass {
                 }
                 out << "\n]";
                 break;
+            case Value::function: out << "fn/" << v.as<FunctionRef>().index; break;
         }
     }
 
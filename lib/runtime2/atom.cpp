@@ -0,0 +1,60 @@
+//===--------------------------------------------------------------------------------------------===
+// atom.cpp - Process-wide interned strings
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include <compass/runtime2/atom.hpp>
+#include <cassert>
+#include <deque>
+#include <mutex>
+
+namespace amyinorbit::compass::rt {
+
+    class AtomTable {
+    public:
+        AtomTable() { intern(""); }
+
+        // Keys are views into strings_, so looking up text that is already interned doesn't copy.
+        Atom intern(std::string_view str) {
+            std::lock_guard<std::mutex> lock(lock_);
+            auto it = ids_.find(str);
+            if(it != ids_.end()) return it->second;
+
+            Atom id = strings_.size();
+            const auto& text = strings_.emplace_back(str.data(), str.size());
+            ids_.emplace(std::string_view(text.data(), text.size()), id);
+            return id;
+        }
+
+        const string& text(Atom atom) {
+            std::lock_guard<std::mutex> lock(lock_);
+            assert(atom < strings_.size() && "invalid atom");
+            return strings_[atom];
+        }
+
+    private:
+        std::mutex lock_;
+        std::deque<string> strings_; // deque, so that references we hand out stay valid
+        map<std::string_view, Atom> ids_;
+    };
+
+    static AtomTable& table() {
+        static AtomTable atoms;
+        return atoms;
+    }
+
+    Atom atom(const string& str) {
+        return table().intern(std::string_view(str.data(), str.size()));
+    }
+
+    Atom atom(std::string_view str) {
+        return table().intern(str);
+    }
+
+    const string& text(Atom atom) {
+        return table().text(atom);
+    }
+}
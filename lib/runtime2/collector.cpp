@@ -7,99 +7,639 @@
 // =^•.•^=
 //===--------------------------------------------------------------------------------------------===
 #include <compass/runtime2/collector.hpp>
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <apfun/view.hpp>
 
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPASS_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define COMPASS_PREFETCH(addr) (void)(addr)
+#endif
+
 namespace amyinorbit::compass::rt {
     using namespace fp;
 
     Collector::Collector() {
-        // before_collection = std::mem_fn(&Collector::default_before_collection);
-        // after_collection = std::mem_fn(&Collector::default_after_collection);
+        grey_.reserve(mark_stack_size);
+    }
+
+    // Cells still have to be destroyed one by one (strings and slot vectors own memory of their
+    // own), but their storage goes back to the system a slab at a time when the pools go.
+    Collector::~Collector() {
+        for(Cell* list: {nursery_, head_}) {
+            while(list) {
+                Cell* next = list->gc.next;
+                destroy(list);
+                list = next;
+            }
+        }
     }
 
-    void Collector::take(Object* obj) {
-        obj->gc.next = head_;
-        obj->gc.stage = !stage_;
-        head_ = obj;
+    Pool& Collector::pool(u32 size) {
+        u32 index = (size + size_class - 1) / size_class - 1;
+        assert(index < size_classes && "cell type is too large for the collector's pools");
+
+        auto& pool = pools_[index];
+        if(!pool) pool = std::make_unique<Pool>((index + 1) * size_class);
+        return *pool;
+    }
+
+    u32 Collector::destroy(Cell* cell) {
+        switch(cell->kind) {
+            case Cell::Kind::object: return dispose(static_cast<Object*>(cell));
+            case Cell::Kind::string: return dispose(static_cast<String*>(cell));
+            case Cell::Kind::list: return dispose(static_cast<List*>(cell));
+        }
+        return 0;
+    }
+
+    void Collector::reclaim(Cell* cell) {
+        event_.swept += 1;
+        event_.bytes_reclaimed += destroy(cell);
+    }
+
+    void Collector::take(Cell* obj) {
+        obj->gc.next = nursery_;
+        obj->gc.stage.store(!stage_, std::memory_order_relaxed);
+        nursery_ = obj;
 
         roots_.push_back(obj);
-        allocated_ += 1;
-        if(!is_paused_ && allocated_ >= next_collection_) collect();
+        nursery_count_ += 1;
+        if(!is_paused_) {
+            if(nursery_count_ >= nursery_size) collect();
+            else if(phase_ == Phase::marking) slice(CollectionEvent::Trigger::allocation);
+        }
         roots_.pop_back();
     }
 
-    Object* Collector::new_object(const Object* prototype, const string& name) {
-        auto obj = new Object(prototype, name);
+    Object* Collector::new_object(const Object* prototype, Atom name) {
+        auto obj = make<Object>(*this, prototype, name);
         take(obj);
         return obj;
     }
 
     Object* Collector::clone(const Object* object) {
-        auto obj = new Object(*object);
+        assert(object->collector_ == this && "cloning an object from another collector");
+        auto obj = make<Object>(*object);
         take(obj);
+
+        // Copying the lists can collect, which can promote the clone: it needs the barrier.
+        push_root(obj);
+        for(auto& slot: obj->slots_) {
+            if(!slot.is<List*>()) continue;
+            slot = copy(slot);
+            write_barrier(obj);
+        }
+        pop_root();
         return obj;
     }
 
-    void Collector::mark(const Object* object) {
-        if(object->gc.stage == stage_) return;
-        allocated_ += 1;
-        object->gc.stage = stage_;
+    String* Collector::new_string(const string& data, Atom atom) {
+        auto str = make<String>(data, atom);
+        take(str);
+        return str;
+    }
 
-        mark(object->prototype_);
+    String* Collector::new_string_view(std::string_view data, Atom atom) {
+        auto str = make<String>(data, atom);
+        take(str);
+        return str;
+    }
 
-        for(const auto& [_, v]: object->fields()) {
-            mark(v);
+    List* Collector::new_list(vector<Value> items) {
+        auto list = make<List>(std::move(items));
+        take(list);
+        return list;
+    }
+
+    Value Collector::copy(const Value& value) {
+        if(!value.is<List*>()) return value;
+
+        auto list = new_list(value.as<List*>()->items);
+        push_root(list);
+        for(auto& item: list->items) {
+            if(!item.is<List*>()) continue;
+            item = copy(item);
+            write_barrier(list);
+        }
+        pop_root();
+        return list;
+    }
+
+    void Collector::remember(const Cell* cell) {
+        cell->gc.remembered = true;
+        remembered_.push_back(cell);
+    }
+
+    void Collector::forget_remembered() {
+        for(const auto* cell: remembered_) cell->gc.remembered = false;
+        remembered_.clear();
+    }
+
+    void Collector::set_incremental(bool enabled, SliceBudget budget) {
+        if(!enabled && phase_ == Phase::marking) {
+            begin_pause(CollectionEvent::Kind::slice, CollectionEvent::Trigger::host);
+            finish_major();
+            end_pause();
         }
+        is_incremental_ = enabled;
+        budget_ = budget;
+    }
+
+    bool Collector::in_scope(const Cell* cell) const {
+        switch(scope_) {
+            case Scope::young: return !cell->gc.old;
+            case Scope::old: return cell->gc.old;
+            case Scope::all: return true;
+        }
+        return true;
+    }
+
+    // Marking never recurses: mark() only shades a cell grey, and cells are traced when they are
+    // popped off the mark stack. Deep lists and long prototype chains can't overflow the native
+    // stack that way.
+    void Collector::mark(const Cell* cell) {
+        if(!cell || !in_scope(cell)) return;
+        if(is_marked(cell)) return;
+        marked_ += 1;
+        event_.marked += 1;
+        cell->gc.stage.store(stage_, std::memory_order_relaxed);
+        shade(cell);
+    }
+
+    void Collector::shade(const Cell* cell) {
+        cell->gc.grey = true;
+        grey_.push_back(cell);
     }
 
     void Collector::mark(const Value& value) {
+        mark(value.cell());
+    }
+
+    void Collector::mark(const vector<Value>& values) {
+        for(const auto& v: values) mark(v);
+    }
+
+    template <typename F>
+    void Collector::each_child(const Cell* cell, F&& f) {
+        // Reaching a child means reading its header, so start loading the next one while this
+        // one is being looked at.
+        auto each = [&](const vector<Value>& values) {
+            for(u32 i = 0; i < values.size(); ++i) {
+                if(i + 1 < values.size()) COMPASS_PREFETCH(values[i + 1].cell());
+                if(auto child = values[i].cell()) f(child);
+            }
+        };
+
+        switch(cell->kind) {
+            case Cell::Kind::object:
+            {
+                auto object = static_cast<const Object*>(cell);
+                if(object->prototype_) f(object->prototype_);
+                each(object->slots());
+            }
+            break;
 
-        switch (value.type()) {
-            case Value::object:
-                mark(value.as<Ref>());
+            case Cell::Kind::list:
+                each(static_cast<const List*>(cell)->items);
                 break;
 
-            case Value::list:
-                for(const auto& v: value.as<Array>())
-                    mark(v);
+            case Cell::Kind::string:
                 break;
+        }
+    }
 
-            default: break;
+    void Collector::trace(const Cell* cell) {
+        each_child(cell, [this](const Cell* child) { mark(child); });
+    }
+
+    void Collector::trace_next() {
+        const Cell* cell = grey_.back();
+        grey_.pop_back();
+        if(!grey_.empty()) COMPASS_PREFETCH(grey_.back());
+        cell->gc.grey = false;
+        trace(cell);
+    }
+
+    void Collector::drain(u32 floor) {
+        while(grey_.size() > floor) trace_next();
+    }
+
+    void Collector::promote(Cell* cell) {
+        cell->gc.old = true;
+        cell->gc.next = head_;
+        head_ = cell;
+        old_count_ += 1;
+    }
+
+    // MARK: - Telemetry
+
+    void Collector::reset_telemetry() {
+        counters_ = GCCounters();
+        pauses_.reset();
+    }
+
+    void Collector::begin_pause(CollectionEvent::Kind kind, CollectionEvent::Trigger trigger) {
+        event_ = CollectionEvent();
+        event_.kind = kind;
+        event_.trigger = trigger;
+        event_.completes_cycle = kind != CollectionEvent::Kind::slice;
+        pause_start_ = std::chrono::steady_clock::now();
+    }
+
+    void Collector::end_pause() {
+        event_.pause = std::chrono::steady_clock::now() - pause_start_;
+        event_.heap_cells = heap_cells();
+        event_.heap_bytes = heap_bytes_;
+
+        switch(event_.kind) {
+            case CollectionEvent::Kind::minor: counters_.minor_collections += 1; break;
+            case CollectionEvent::Kind::full: counters_.full_collections += 1; break;
+            case CollectionEvent::Kind::slice: counters_.slices += 1; break;
         }
+        counters_.cells_marked += event_.marked;
+        counters_.cells_swept += event_.swept;
+        counters_.bytes_reclaimed += event_.bytes_reclaimed;
+        counters_.total_pause += event_.pause;
+        counters_.max_pause = std::max(counters_.max_pause, event_.pause);
+        pauses_.record(event_.pause);
+
+        if(event_.completes_cycle && after_collection) after_collection(*this);
     }
 
+    // MARK: - Collection
+
     void Collector::collect() {
+        using Kind = CollectionEvent::Kind;
+        using Trigger = CollectionEvent::Trigger;
+
+        begin_pause(Kind::minor, Trigger::nursery_full);
+        if(phase_ == Phase::idle && old_count_ >= next_major_ && !is_incremental_) {
+            event_.kind = Kind::full;
+            event_.trigger = Trigger::old_generation;
+            collect_major();
+            end_pause();
+            return;
+        }
+
+        // When a full collection is incremental, the nursery is emptied first: the first slices
+        // then only have old cells to look at.
+        collect_minor();
+        end_pause();
+
+        if(phase_ == Phase::marking) {
+            slice(Trigger::allocation);
+        } else if(old_count_ >= next_major_ && is_incremental_) {
+            begin_pause(Kind::slice, Trigger::old_generation);
+            begin_major();
+            end_pause();
+        }
+    }
+
+    void Collector::collect_minor() {
+        // Old cells are left alone: anything they keep alive in the nursery is reached through
+        // the remembered set instead.
+        // If the old generation is being marked, its grey cells are at the bottom of the mark
+        // stack; they are left there for the next slice.
+        u32 floor = grey_.size();
+        scope_ = Scope::young;
+        if(before_collection) before_collection(*this);
+        for(const auto& v : roots_) mark(v);
+        for(const auto* cell: remembered_) trace(cell);
+        drain(floor);
+        scope_ = Scope::all;
+
+        // Survivors move to the old generation. Their tag goes back to 'unmarked', since the
+        // stage doesn't flip after a minor collection -- unless the old generation is being
+        // marked, in which case they are grey: they could point to old cells nothing else
+        // reaches any more.
+        Cell* cell = nursery_;
+        while(cell) {
+            Cell* next = cell->gc.next;
+            if(is_marked(cell)) {
+                if(phase_ == Phase::marking) {
+                    shade(cell);
+                } else {
+                    cell->gc.stage.store(!stage_, std::memory_order_relaxed);
+                }
+                promote(cell);
+            } else {
+                reclaim(cell);
+            }
+            cell = next;
+        }
+        nursery_ = nullptr;
+        nursery_count_ = 0;
+
+        // Every young cell is now old, so there are no old-to-young references left to remember.
+        forget_remembered();
+    }
+
+    void Collector::collect_major() {
         // Because we use a 'flip/flop' tag instead of a 'reachable' tag, we don't need to
         // traverse the object graph every time we collect. Win!
 
         // First step is marking things we know we can reach. Roots, and anything that the delegate
         // tells us about.
-        std::cout << "[gc]: garbage collection starting: " << allocated_ << " objects\n";
+        marked_ = 0;
+        if(before_collection) before_collection(*this);
+        for(const auto& v : roots_) mark(v);
+        if(mark_threads_ > 1) drain_parallel(); else drain(0);
+        sweep();
+    }
 
-        allocated_ = 0;
+    /*
+    Incremental collections use the tri-colour invariant on top of the stage tag: white cells
+    don't have the current stage, grey ones have it and are waiting on the mark stack, and black
+    ones have it and have been traced. A black cell must never point to a white one, so write_barrier()
+    turns black cells grey again when something is stored in them.
+
+    Slices only look at the old generation. Young cells are taken care of by finish_major(), which
+    runs atomically once there is nothing grey left.
+    */
+    void Collector::begin_major() {
+        assert(phase_ == Phase::idle);
+        phase_ = Phase::marking;
+        marked_ = 0;
+
+        scope_ = Scope::old;
         if(before_collection) before_collection(*this);
         for(const auto& v : roots_) mark(v);
+        scope_ = Scope::all;
+    }
+
+    void Collector::step() {
+        slice(CollectionEvent::Trigger::host);
+    }
 
+    void Collector::slice(CollectionEvent::Trigger trigger) {
+        if(phase_ != Phase::marking || is_paused_) return;
+        using clock = std::chrono::steady_clock;
+        begin_pause(CollectionEvent::Kind::slice, trigger);
+        static constexpr u32 clock_interval = 64;
+
+        auto deadline = clock::now() + budget_.time;
+        u32 work = 0;
+
+        scope_ = Scope::old;
+        while(!grey_.empty()) {
+            trace_next();
+
+            work += 1;
+            if(budget_.work && work >= budget_.work) break;
+            if(budget_.time.count() && work % clock_interval == 0 && clock::now() >= deadline) break;
+        }
+        scope_ = Scope::all;
+
+        if(grey_.empty()) finish_major();
+        end_pause();
+    }
+
+    void Collector::finish_major() {
+        // Roots aren't behind a write barrier, so they have to be scanned again. Young cells are
+        // reached from them and from the remembered set, like in a minor collection.
+        if(before_collection) before_collection(*this);
+        for(const auto& v : roots_) mark(v);
+        for(const auto* cell: remembered_) trace(cell);
+        drain(0);
+
+        phase_ = Phase::idle;
+        event_.completes_cycle = true;
+        sweep();
+    }
+
+    void Collector::sweep() {
         // Then we can nuke anything that isn't marked
-        using Ref = Object*;
-        Ref* head_ptr = &head_;
+        old_count_ = 0;
+        Cell** head_ptr = &head_;
         while(*head_ptr) {
-            Ref obj = *head_ptr;
-            if(obj->gc.stage != stage_) {
+            Cell* obj = *head_ptr;
+            if(!is_marked(obj)) {
                 *head_ptr = obj->gc.next;
-                delete obj;
+                reclaim(obj);
             } else {
                 head_ptr = &obj->gc.next;
+                old_count_ += 1;
             }
         }
 
+        // Young survivors are promoted too, keeping their mark until the stage flips.
+        Cell* cell = nursery_;
+        while(cell) {
+            Cell* next = cell->gc.next;
+            if(is_marked(cell)) promote(cell); else reclaim(cell);
+            cell = next;
+        }
+        nursery_ = nullptr;
+        nursery_count_ = 0;
+        forget_remembered();
+
         // Finally we need to flip the stage marker.
         stage_ = !stage_;
-        if(after_collection) after_collection(*this);
-        next_collection_ = allocated_ > default_collection_threshold
-            ? allocated_ * growth_factor
+        next_major_ = marked_ > default_collection_threshold
+            ? marked_ * growth_factor
             : default_collection_threshold;
-        std::cout << "[gc]: garbage collection done: " << allocated_ << " objects\n";
+    }
+
+    // MARK: - Parallel marking
+
+    /*
+    Roots are marked on the collecting thread as usual, then the mark stack is dealt out to the
+    workers -- the collecting thread being worker 0. Each worker traces from a private stack, and
+    moves the older half of it to its deque when it grows large and the deque is empty. Workers
+    that run out of cells steal from the front of the others' deques. Cells are claimed by
+    swapping their stage tag atomically, so each one is only ever traced once.
+    */
+    struct Collector::Workers {
+        static constexpr u32 share_threshold = 64;
+
+        struct Worker {
+            std::mutex lock;
+            std::deque<const Cell*> shared;
+            std::atomic<u32> available{0};
+            vector<const Cell*> local;
+            u32 marked = 0;
+        };
+
+        Workers(Collector& gc, u32 count);
+        ~Workers();
+
+        void run();
+        void work(u32 index);
+        void claim(Worker& worker, const Cell* cell);
+        void share(Worker& worker);
+        bool take(Worker& worker);
+        bool steal(u32 thief);
+        bool has_work() const;
+
+        Collector& gc;
+        vector<std::unique_ptr<Worker>> workers;
+        vector<std::thread> threads;
+        std::atomic<u32> idle{0};
+
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable done;
+        u64 round = 0;
+        u32 running = 0;
+        bool stop = false;
+    };
+
+    Collector::Workers::Workers(Collector& gc, u32 count) : gc(gc) {
+        for(u32 i = 0; i < count; ++i) workers.push_back(std::make_unique<Worker>());
+
+        for(u32 i = 1; i < count; ++i) {
+            threads.emplace_back([this, i] {
+                u64 seen = 0;
+                for(;;) {
+                    {
+                        std::unique_lock<std::mutex> guard(lock);
+                        wake.wait(guard, [&] { return stop || round != seen; });
+                        if(stop) return;
+                        seen = round;
+                    }
+                    work(i);
+                    std::lock_guard<std::mutex> guard(lock);
+                    if(--running == 0) done.notify_one();
+                }
+            });
+        }
+    }
+
+    Collector::Workers::~Workers() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = true;
+        }
+        wake.notify_all();
+        for(auto& thread: threads) thread.join();
+    }
+
+    void Collector::Workers::run() {
+        idle.store(0);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            round += 1;
+            running = threads.size();
+        }
+        wake.notify_all();
+        work(0);
+
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [&] { return running == 0; });
+    }
+
+    void Collector::Workers::claim(Worker& worker, const Cell* cell) {
+        bool stage = gc.stage_;
+        if(cell->gc.stage.load(std::memory_order_relaxed) == stage) return;
+        if(cell->gc.stage.exchange(stage, std::memory_order_relaxed) == stage) return;
+        worker.marked += 1;
+        worker.local.push_back(cell);
+    }
+
+    void Collector::Workers::work(u32 index) {
+        auto& worker = *workers[index];
+        for(;;) {
+            while(!worker.local.empty()) {
+                const Cell* cell = worker.local.back();
+                worker.local.pop_back();
+                if(!worker.local.empty()) COMPASS_PREFETCH(worker.local.back());
+
+                each_child(cell, [&](const Cell* child) { claim(worker, child); });
+                if(worker.local.size() > share_threshold) share(worker);
+            }
+            if(take(worker) || steal(index)) continue;
+
+            // Nothing left here. Marking is over once every worker is idle: a worker only goes
+            // idle once its own deque is empty, and only its owner ever fills a deque.
+            idle.fetch_add(1);
+            for(;;) {
+                if(idle.load() == workers.size()) return;
+                if(has_work()) {
+                    idle.fetch_sub(1);
+                    break;
+                }
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void Collector::Workers::share(Worker& worker) {
+        if(worker.available.load(std::memory_order_relaxed)) return;
+
+        std::lock_guard<std::mutex> guard(worker.lock);
+        auto half = worker.local.begin() + worker.local.size() / 2;
+        worker.shared.insert(worker.shared.end(), worker.local.begin(), half);
+        worker.local.erase(worker.local.begin(), half);
+        worker.available.store(worker.shared.size());
+    }
+
+    bool Collector::Workers::take(Worker& worker) {
+        if(!worker.available.load(std::memory_order_relaxed)) return false;
+
+        std::lock_guard<std::mutex> guard(worker.lock);
+        if(worker.shared.empty()) return false;
+        worker.local.insert(worker.local.end(), worker.shared.begin(), worker.shared.end());
+        worker.shared.clear();
+        worker.available.store(0);
+        return true;
+    }
+
+    bool Collector::Workers::steal(u32 thief) {
+        auto& into = *workers[thief];
+        for(u32 i = 1; i < workers.size(); ++i) {
+            auto& victim = *workers[(thief + i) % workers.size()];
+            if(!victim.available.load(std::memory_order_relaxed)) continue;
+
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if(victim.shared.empty()) continue;
+
+            auto count = (victim.shared.size() + 1) / 2;
+            auto end = victim.shared.begin() + count;
+            into.local.insert(into.local.end(), victim.shared.begin(), end);
+            victim.shared.erase(victim.shared.begin(), end);
+            victim.available.store(victim.shared.size());
+            return true;
+        }
+        return false;
+    }
+
+    bool Collector::Workers::has_work() const {
+        for(const auto& worker: workers) {
+            if(worker->available.load(std::memory_order_relaxed)) return true;
+        }
+        return false;
+    }
+
+    void Collector::set_mark_threads(u32 count) {
+        count = std::max<u32>(count, 1);
+        if(count == mark_threads_) return;
+        workers_.reset();
+        mark_threads_ = count;
+    }
+
+    void Collector::drain_parallel() {
+        if(!workers_) workers_ = std::make_unique<Workers>(*this, mark_threads_);
+        auto& workers = workers_->workers;
+
+        for(u32 i = 0; i < grey_.size(); ++i) {
+            grey_[i]->gc.grey = false;
+            workers[i % workers.size()]->local.push_back(grey_[i]);
+        }
+        grey_.clear();
+
+        workers_->run();
+
+        for(auto& worker: workers) {
+            marked_ += worker->marked;
+            event_.marked += worker->marked;
+            worker->marked = 0;
+        }
     }
 }
@@ -19,25 +19,40 @@ namespace amyinorbit::compass {
         u16 emitJump(Bytecode inst);
         void patchJump(u16 id);
     */
+    // Caches are sized when the function is decoded (see VM::decode()).
+    Function::Function(vector<u8> bytecode, u16 max_stack)
+        : bytecode_(std::move(bytecode)), max_stack_(max_stack) {}
+
+    Function::Function(const u8* code, u32 size, u16 max_stack)
+        : external_(code), external_size_(size), max_stack_(max_stack) {}
+
     void Function::emit(Bytecode inst) {
-        bytecode_.push_back(static_cast<u16>(inst));
+        bytecode_.push_back(static_cast<u8>(inst));
     }
 
     void Function::emit(Bytecode inst, u16 constant) {
         emit(inst);
-        bytecode_.push_back(constant);
+        write_operand(bytecode_, inst, constant);
     }
 
     u16 Function::emitJump(Bytecode inst) {
+        assert(is_jump(inst) && "not a jump instruction");
         emit(inst);
         u16 loc = bytecode_.size();
-        bytecode_.push_back(0xcafe);
+        bytecode_.push_back(0xfe);
+        bytecode_.push_back(0xca);
         return loc;
     }
 
+    void Function::emitField(u16 name) {
+        emit(Bytecode::loadf);
+        write_operand(bytecode_, Bytecode::loadf, name | (u32(caches_.size()) << 16));
+        caches_.emplace_back();
+    }
+
     void Function::patchJump(u16 id) {
-        assert(id < bytecode_.size());
+        assert(id + 1u < bytecode_.size());
         i32 loc = bytecode_.size();
-        bytecode_[id] = loc - id;
+        write_u16(&bytecode_[id], loc - id);
     }
 }
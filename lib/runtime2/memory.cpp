@@ -7,131 +7,360 @@
 // =^•.•^=
 //===--------------------------------------------------------------------------------------------===
 #include <compass/runtime2/memory.hpp>
+#include <algorithm>
 #include <cassert>
+#include <iostream>
+#include <iterator>
+#include <new>
+
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define COMPASS_RESERVE_MEMORY 1
+#else
+#define COMPASS_RESERVE_MEMORY 0
+#endif
 
 namespace amyinorbit::compass {
 
-    template <typename T, typename U>
-    T* as(U* ptr) {
-        return reinterpret_cast<T*>(ptr);
+    static u32 lowest_bit(u64 bits) {
+        assert(bits && "no bit set");
+    #if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll(bits);
+    #else
+        u32 n = 0;
+        while(!(bits & 1)) {
+            bits >>= 1;
+            n += 1;
+        }
+        return n;
+    #endif
+    }
+
+    // Reserves [capacity] bytes of address space. Anonymous mappings are zero-filled on first
+    // touch, which is when the OS actually commits each page.
+    static u8* reserve(std::size_t capacity, Memory::Paging paging) {
+    #if COMPASS_RESERVE_MEMORY
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    #ifdef MAP_NORESERVE
+        flags |= MAP_NORESERVE;
+    #endif
+        void* base = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if(base == MAP_FAILED) throw std::bad_alloc();
+    #ifdef MADV_HUGEPAGE
+        if(paging == Memory::Paging::huge) madvise(base, capacity, MADV_HUGEPAGE);
+    #endif
+        return static_cast<u8*>(base);
+    #else
+        (void)paging;
+        return new u8[capacity]();
+    #endif
+    }
+
+    static void release(u8* data, std::size_t capacity) {
+        if(!data) return;
+    #if COMPASS_RESERVE_MEMORY
+        munmap(data, capacity);
+    #else
+        (void)capacity;
+        delete [] data;
+    #endif
     }
 
-    Memory::Memory(size_type capacity) : capacity_(capacity), free_list_(16) {
-        data_ = new u8[capacity];
+    Memory::Memory(size_type capacity, Paging paging)
+        : capacity_(capacity)
+        , first_(first_block)
+        , end_(capacity & ~(align - 1)) {
+        assert(end_ >= first_block + block_overhead + min_payload && "memory too small");
+        data_ = reserve(capacity, paging);
         write<float>(0, 123.f);
 
-        ref<size_type>(free_list_ + block_size_offset) = capacity_ - block_header_size;
-        ref<bool>(free_list_ + block_free_offset) = true;
-        ref<size_type>(free_list_ + block_next_offset) = 0;
+        tag(first_, end_ - first_ - block_overhead, true);
+        bin(first_);
     }
 
     Memory::Memory(Memory&& other)
-        : data_(other.data_), capacity_(other.capacity_), free_list_(other.free_list_) {
+        : data_(other.data_)
+        , capacity_(other.capacity_)
+        , first_(other.first_)
+        , end_(other.end_)
+        , small_map_(other.small_map_)
+        , large_(std::move(other.large_)) {
+        std::copy(std::begin(other.small_), std::end(other.small_), std::begin(small_));
         other.data_ = nullptr;
         other.capacity_ = 0;
-        other.free_list_ = 0;
+        other.first_ = 0;
+        other.end_ = 0;
+        other.small_map_ = 0;
+        other.large_.clear();
     }
 
     Memory::~Memory() {
-        delete [] data_;
+        release(data_, capacity_);
+        data_ = nullptr;
         capacity_ = 0;
-        free_list_ = 0;
+        first_ = 0;
     }
 
     Memory::size_type Memory::alloc(size_type slots) {
-        size_type required = slots * align;
-        // std::cerr << "[memory]: " << "alloc " << slots << " slots (" << required << " bytes)\n";
+        size_type required = std::max(slots * align, min_payload);
+        size_type block = take(required);
+        if(!block) return 0;
+
+        if(block_size(block) >= required + block_overhead + min_payload) {
+            split(block, required);
+        }
+        tag(block, block_size(block), false);
+        ref<u64>(block + free_prev_offset) = 0; // free list links: keep fresh blocks zero-filled
+        return block + block_header_size;
+    }
+
+    void Memory::dealloc(size_type address) {
+        assert(address < capacity_ && "invalid memory block address");
+        size_type block = address - block_header_size;
+        assert(!is_free(block) && "double free");
+        size_type size = block_size(block);
+
+        size_type next = next_block(block);
+        if(next && is_free(next)) {
+            unbin(next);
+            size += block_overhead + block_size(next);
+        }
 
-        size_type addr = free_list_;
+        size_type prev = prev_block(block);
+        if(prev && is_free(prev)) {
+            unbin(prev);
+            size += block_overhead + block_size(prev);
+            block = prev;
+        }
+
+        tag(block, size, true);
+        bin(block);
+    }
+
+    Memory::Stats Memory::stats() const {
+        Stats stats;
+        stats.capacity = capacity_ - first_block;
+        for(size_type block = first_; block; block = next_block(block)) {
+            auto size = block_size(block);
+            if(is_free(block)) {
+                stats.free += size;
+                stats.free_blocks += 1;
+                stats.largest_free = std::max(stats.largest_free, size);
+            } else {
+                stats.used += size;
+                stats.used_blocks += 1;
+            }
+        }
+        return stats;
+    }
 
-        while(addr) {
+    bool Memory::verify() const {
+        u32 free_blocks = 0;
+        bool prev_free = false;
+        size_type block = first_;
 
-            // std::cerr << "  ----    block at " << addr << "\n";
-            auto is_free = ref<bool>(addr + block_free_offset);
-            auto size = ref<size_type>(addr + block_size_offset);
-            if(!is_free || size < required) {
-                // std::cerr << "          block not available (" << (is_free ? "free" : "not free") << ", " << size << ")\n";
-                addr = ref<size_type>(addr + block_next_offset);
-                continue;
+        while(block) {
+            auto size = block_size(block);
+            if(size < min_payload || size % align) return false;
+            if(footer(block) + block_footer_size > end_) return false;
+            if(ref<size_type>(footer(block) + tag_size_offset) != size) return false;
+            if(ref<u32>(footer(block) + tag_free_offset) != ref<u32>(block + tag_free_offset)) {
+                return false;
             }
 
-            if(size > (required + block_header_size + relax_param)) {
-                // std::cerr << "          splitting block (" << required << "/" << size << ")\n";
-                split(addr, required);
+            if(is_free(block)) {
+                if(prev_free) return false; // should have been merged
+                free_blocks += 1;
             }
-            // std::cerr << "          allocated block (" << addr << ":" << required << ")\n";
-            return addr + block_header_size;
+            prev_free = is_free(block);
+
+            auto next = next_block(block);
+            if(next && prev_block(next) != block) return false;
+            if(!next && footer(block) + block_footer_size != end_) return false;
+            block = next;
         }
-        // std::cerr << "[memory]: no block large enough\n";
-        return 0;
+
+        u32 binned = large_.size();
+        for(const auto& [size, entry]: large_) {
+            if(size < small_limit || block_size(entry) != size || !is_free(entry)) return false;
+        }
+        for(size_type index = 0; index < small_classes; ++index) {
+            bool listed = small_map_ & (u64(1) << index);
+            if(listed != (small_[index] != 0)) return false;
+
+            size_type prev = 0;
+            for(size_type entry = small_[index]; entry; ) {
+                if(!is_free(entry) || block_size(entry) != index * align) return false;
+                if(ref<size_type>(entry + free_prev_offset) != prev) return false;
+                prev = entry;
+                entry = ref<size_type>(entry + free_next_offset);
+                binned += 1;
+            }
+        }
+        return binned == free_blocks;
     }
 
     void Memory::debug(const string& marker) const {
-        size_type addr = free_list_;
-
         std::cout << "\n==memdump (" << marker << ")==\n";
-        while(addr) {
-            auto is_free = ref<bool>(addr + block_free_offset);
-            auto size = ref<size_type>(addr + block_size_offset);
-
+        for(size_type addr = first_; addr; addr = next_block(addr)) {
             std::cout << "|-----------------\n";
             std::cout << "| addr: " << std::hex << addr << std::dec << "\n";
-            std::cout << "| size: " << size << "\n";
-            std::cout << "| used: " << (is_free ? "no" : "yes") << "\n";
-
-            addr = ref<size_type>(addr + block_next_offset);
+            std::cout << "| size: " << block_size(addr) << "\n";
+            std::cout << "| used: " << (is_free(addr) ? "no" : "yes") << "\n";
         }
         std::cout << "|-----------------\n\n";
     }
 
-    void Memory::dealloc(size_type address) {
-        assert(address < capacity_ && "invalid memory block address");
-        address -= block_header_size;
-        // std::cerr << "[memory]: deallocating block at " << address << "\n";
-        ref<bool>(address + block_free_offset) = true;
-        merge();
-    }
-
-    void Memory::merge() {
-        size_type current = free_list_;
-
-        while(current) {
-            bool is_free = ref<bool>(current + block_free_offset);
-            auto next = ref<size_type>(current + block_next_offset);
-            if(!is_free) {
-                current = next;
-                continue;
-            };
-            bool next_is_free = ref<bool>(next + block_free_offset);
-            if(!next_is_free) {
-                current = next;
-                continue;
+    // MARK: - Free lists
+
+    // Removes the smallest free block that can hold [size] bytes from its list.
+    Memory::size_type Memory::take(size_type size) {
+        if(size < small_limit) {
+            u64 candidates = small_map_ & (~u64(0) << (size / align));
+            if(candidates) {
+                size_type block = small_[lowest_bit(candidates)];
+                unbin(block);
+                return block;
             }
+        }
+
+        auto it = large_.lower_bound({size, 0});
+        if(it == large_.end()) return 0;
+        size_type block = it->second;
+        large_.erase(it);
+        return block;
+    }
+
+    void Memory::bin(size_type block) {
+        assert(is_free(block));
+        auto size = block_size(block);
+        if(size >= small_limit) {
+            large_.emplace(size, block);
+            return;
+        }
+
+        auto index = size / align;
+        size_type head = small_[index];
+        ref<size_type>(block + free_prev_offset) = 0;
+        ref<size_type>(block + free_next_offset) = head;
+        if(head) ref<size_type>(head + free_prev_offset) = block;
+        small_[index] = block;
+        small_map_ |= u64(1) << index;
+    }
+
+    void Memory::unbin(size_type block) {
+        auto size = block_size(block);
+        if(size >= small_limit) {
+            large_.erase({size, block});
+            return;
+        }
+
+        auto index = size / align;
+        auto prev = ref<size_type>(block + free_prev_offset);
+        auto next = ref<size_type>(block + free_next_offset);
+        if(prev) {
+            ref<size_type>(prev + free_next_offset) = next;
+        } else {
+            small_[index] = next;
+        }
+        if(next) ref<size_type>(next + free_prev_offset) = prev;
+        if(!small_[index]) small_map_ &= ~(u64(1) << index);
+    }
+
+    // MARK: - Block tags
+
+    void Memory::tag(size_type block, size_type size, bool free) {
+        ref<size_type>(block + tag_size_offset) = size;
+        ref<u32>(block + tag_free_offset) = free;
+        size_type end = block + block_header_size + size;
+        ref<size_type>(end + tag_size_offset) = size;
+        ref<u32>(end + tag_free_offset) = free;
+    }
 
-            // std::cerr << "[memory]: merging blocks\n";
+    // Cuts [block] down to [size] bytes, and puts the rest back in the free lists.
+    void Memory::split(size_type block, size_type size) {
+        auto rest = block + block_overhead + size;
+        tag(rest, block_size(block) - (size + block_overhead), true);
+        tag(block, size, is_free(block));
+        bin(rest);
+    }
 
-            auto size = ref<size_type>(current + block_size_offset)
-                        + ref<size_type>(next + block_size_offset)
-                        + block_header_size;
-            next = current + size + block_header_size;
+    // MARK: - Guarded regions
 
-            ref<size_type>(current + block_size_offset) = size;
-            ref<size_type>(current + block_next_offset) = next;
-            current = current + next;
+    GuardedRegion::GuardedRegion(size_type capacity, Memory::Paging paging) {
+    #if COMPASS_RESERVE_MEMORY
+        size_type page = sysconf(_SC_PAGESIZE);
+        capacity_ = (capacity + page - 1) / page * page;
+        std::size_t reserved = std::size_t(capacity_) + 2 * page;
+        u8* base = reserve(reserved, paging);
+        if(mprotect(base, page, PROT_NONE) == 0
+           && mprotect(base + page + capacity_, page, PROT_NONE) == 0) {
+            guard_size_ = page;
+            data_ = base + page;
+            return;
         }
+        // The guards couldn't be put up, so the region goes without them: it is reserved again at
+        // its own size, and guard_size_ stays 0.
+        release(base, reserved);
+    #else
+        capacity_ = capacity;
+    #endif
+        data_ = reserve(capacity_, paging);
+    }
+
+    GuardedRegion::~GuardedRegion() {
+        if(!data_) return;
+        release(data_ - guard_size_, std::size_t(capacity_) + 2 * guard_size_);
     }
 
-    void Memory::split(size_type addr, size_type size) {
-        auto current_size = ref<size_type>(addr + block_size_offset);
-        auto current_next = ref<size_type>(addr + block_next_offset);
-        auto new_addr = addr + 3 * align + size;
+    GuardedRegion::Guard GuardedRegion::guard_at(const void* address) const {
+        if(!guard_size_) return Guard::none;
+        auto ptr = static_cast<const u8*>(address);
+        if(ptr < data_ && ptr >= data_ - guard_size_) return Guard::below;
+        if(ptr >= end() && ptr < end() + guard_size_) return Guard::above;
+        return Guard::none;
+    }
 
-        ref<size_type>(new_addr + block_size_offset) = current_size - (size + block_header_size);
-        ref<bool>(new_addr + block_free_offset) = true;
-        ref<size_type>(new_addr + block_next_offset) = current_next;
+    // MARK: - Mapped files
+
+    MappedFile::MappedFile(const char* path) {
+    #if COMPASS_RESERVE_MEMORY
+        int fd = open(path, O_RDONLY);
+        if(fd < 0) return;
+
+        struct stat info;
+        if(fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* base = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(base != MAP_FAILED) {
+                data_ = static_cast<const u8*>(base);
+                size_ = info.st_size;
+                mapped_ = true;
+            }
+        }
+        // The mapping stays valid once the file is closed.
+        close(fd);
+        if(mapped_) return;
+    #endif
+        std::ifstream in(path, std::ios::binary);
+        buffer_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+    }
+
+    MappedFile::MappedFile(std::istream& in)
+        : buffer_(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()) {
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+    }
 
-        ref<size_type>(addr + block_size_offset) = size;
-        ref<bool>(addr + block_free_offset) = false;
-        ref<size_type>(addr + block_next_offset) = new_addr;
+    MappedFile::~MappedFile() {
+    #if COMPASS_RESERVE_MEMORY
+        if(mapped_) munmap(const_cast<u8*>(data_), size_);
+    #endif
     }
 }
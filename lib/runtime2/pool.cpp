@@ -0,0 +1,29 @@
+//===--------------------------------------------------------------------------------------------===
+// pool.cpp - Slab allocator implementation
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include <compass/runtime2/pool.hpp>
+#include <cassert>
+#include <cstddef>
+
+namespace amyinorbit::compass::rt {
+
+    Pool::Pool(u32 cell_size) : cell_size_(cell_size) {
+        assert(cell_size >= sizeof(FreeCell) && "cells are too small to be put on the free list");
+        assert(cell_size % alignof(std::max_align_t) == 0 && "cells would be misaligned");
+        assert(cell_size <= slab_size);
+    }
+
+    void Pool::grow() {
+        // new[] of a byte array is aligned for any fundamental type, and so is every cell after
+        // the first since their size is a multiple of that alignment.
+        u32 count = slab_size / cell_size_;
+        slabs_.emplace_back(new u8[count * cell_size_]);
+        bump_ = slabs_.back().get();
+        end_ = bump_ + count * cell_size_;
+    }
+}
@@ -0,0 +1,35 @@
+//===--------------------------------------------------------------------------------------------===
+// shape.cpp - Shape tree implementation
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include <compass/runtime2/shape.hpp>
+
+namespace amyinorbit::compass::rt {
+
+    const Shape* ShapeTree::root() {
+        roots_.emplace_back(new Shape());
+        return roots_.back().get();
+    }
+
+    Shape::Shape(const Shape& parent, Atom field)
+        : fields_(parent.fields_)
+        , slots_(parent.slots_) {
+        slots_[field] = fields_.size();
+        fields_.push_back(field);
+    }
+
+    const Shape* Shape::with(Atom field) const {
+        auto& next = transitions_[field];
+        if(!next) next.reset(new Shape(*this, field));
+        return next.get();
+    }
+
+    i32 Shape::slot(Atom field) const {
+        auto it = slots_.find(field);
+        return it != slots_.end() ? it->second : not_found;
+    }
+}
@@ -7,45 +7,101 @@
 // =^•.•^=
 //===--------------------------------------------------------------------------------------------===
 #include <compass/runtime2/type.hpp>
+#include <compass/runtime2/collector.hpp>
 #include <cassert>
 
 namespace amyinorbit::compass::rt {
 
-    Value::Type Value::type() const {
-        if(is<Defer>()) return as<Defer>().tag;
-        return static_cast<Type>(data_.index());
-    }
-
-    Object::Object(const Object* prototype, string name)
-        : prototype_(prototype)
+    Object::Object(Collector& collector, const Object* prototype, Atom name)
+        : Cell(Kind::object)
+        , prototype_(prototype)
         , name_(name)
+        , shape_(prototype ? prototype->heir_shape() : collector.shapes().empty())
+        , collector_(&collector)
         , is_linked_(true) {
-        if(prototype) {
-            fields_ = prototype->fields_;
+        assert((!prototype || prototype->collector_ == collector_)
+               && "prototype belongs to another collector");
+    }
+
+    // Clones share the prototype chain, but not heirs: those would get a shape tree of their own.
+    // Their lists are still the original's here. Collector::clone() copies them once the clone is
+    // a cell it can root.
+    Object::Object(const Object& other)
+        : Cell(Kind::object)
+        , prototype_(other.prototype_)
+        , name_(other.name_)
+        , shape_(other.shape_)
+        , slots_(other.slots_)
+        , collector_(other.collector_)
+        , is_linked_(other.is_linked_) {
+    }
+
+    const Shape* Object::heir_shape() const {
+        if(!heir_shape_) heir_shape_ = collector_->shapes().root();
+        return heir_shape_;
+    }
+
+    const Value* Object::find(Atom name) const {
+        for(const Object* obj = this; obj; obj = obj->prototype_) {
+            auto slot = obj->shape_->slot(name);
+            if(slot != Shape::not_found) return &obj->slots_[slot];
         }
+        return nullptr;
     }
 
-    bool Object::has_field(const string& name) const {
-        return fields_.count(name) != 0;
+    bool Object::has_field(Atom name) const {
+        return find(name) != nullptr;
     }
 
-    Value& Object::field(const string& name) {
-        // assert(fields_.count(name) && "invalid field access");
-        return fields_[name];
+    // An inherited list is copied into the slot, so that writing to it leaves the prototype's
+    // alone. That can collect, so the barrier comes after.
+    Value& Object::field(Atom name) {
+        auto slot = shape_->slot(name);
+        if(slot == Shape::not_found) {
+            auto inherited = prototype_ ? prototype_->find(name) : nullptr;
+            auto value = inherited ? collector_->copy(*inherited) : Value();
+            if(heir_shape_) collector_->shapes().bump_epoch();
+
+            shape_ = shape_->with(name);
+            slot = slots_.size();
+            slots_.push_back(value);
+        }
+        collector_->write_barrier(this);
+        return slots_[slot];
     }
 
-    const Value& Object::field(const string& name) const {
-        assert(fields_.count(name) && "invalid field access");
-        return fields_.at(name);
+    const Value& Object::field(Atom name) const {
+        auto value = find(name);
+        assert(value && "invalid field access");
+        return *value;
     }
 
-    bool Object::is_a(const string& kind) const {
-        if(name_ == kind) return true;
-        if(!prototype()) return false;
-        return prototype()->is_a(kind);
+    const Value* Object::field(Atom name, FieldCache& cache) const {
+        u32 epoch = collector_->shapes().epoch();
+
+        if(auto entry = cache.find(shape_)) {
+            if(entry->depth == 0) return &slots_[entry->slot];
+            if(entry->epoch == epoch) {
+                const Object* holder = this;
+                for(u16 i = 0; i < entry->depth; ++i) holder = holder->prototype_;
+                return &holder->slots_[entry->slot];
+            }
+        }
+
+        u16 depth = 0;
+        for(const Object* obj = this; obj; obj = obj->prototype_, ++depth) {
+            auto slot = obj->shape_->slot(name);
+            if(slot == Shape::not_found) continue;
+            cache.insert({shape_, u16(slot), depth, epoch});
+            return &obj->slots_[slot];
+        }
+        return nullptr;
     }
 
-    bool Object::is_a(const Object* kind) const {
-        return is_a(kind->name());
+    bool Object::is_a(Atom kind) const {
+        for(const Object* obj = this; obj; obj = obj->prototype_) {
+            if(obj->name_ == kind) return true;
+        }
+        return false;
     }
 }
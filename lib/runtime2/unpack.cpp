@@ -13,9 +13,21 @@
 namespace amyinorbit::compass {
     using namespace rt;
 
+    Loader::Loader(rt::Collector& collector, std::istream& in)
+        : collector_(collector)
+        , file_(std::make_shared<MappedFile>(in))
+        , reader_(file_->data(), file_->size()) {}
+
+    Loader::Loader(rt::Collector& collector, const char* path)
+        : collector_(collector)
+        , file_(std::make_shared<MappedFile>(path))
+        , reader_(file_->data(), file_->size()) {}
+
     void Loader::load() {
         if(!signature()) return;
-        reader_.forward(4 * sizeof(u32));
+        collector_.pause();
+        u32 functions_offset = reader_.read<u32>();
+        reader_.forward(3 * sizeof(u32));
 
         std::cout << std::hex;
 
@@ -36,13 +48,19 @@ namespace amyinorbit::compass {
             constant();
         }
 
+        if(functions_offset != 0xffffffff) {
+            reader_.go(functions_offset);
+            u16 functions_count = reader_.read<u16>();
+            for(u16 i = 0; i < functions_count; ++i) {
+                function();
+            }
+        }
 
         reader_.go(heap_offset);
         u16 heap_count = reader_.read<u16>();
         for(u16 i = 0; i < heap_count; ++i) {
             object();
         }
-        collector_.pause();
         link();
         collector_.resume();
     }
@@ -53,41 +71,63 @@ namespace amyinorbit::compass {
         switch (tag) {
         case Tag::data_utf8: utf8(); break;
         case Tag::data_list: list(); break;
-        default: break;
+        default:
+            {
+                // Scalars are stored inline, and still take up a slot in the pool. References to
+                // objects and functions keep a nil slot until link() can fill them in.
+                reader_.backward(1);
+                auto val = value();
+                if(auto ref = std::get_if<Deferred>(&val)) {
+                    deferred_constants_.push_back({u16(constants_.size()), *ref});
+                    constants_.push_back(nil_tag);
+                } else {
+                    constants_.push_back(std::get<Value>(val));
+                }
+            }
+            break;
         }
     }
 
     void Loader::utf8() {
-        constants_.push_back(reader_.read_string());
-        std::cout << "\t" << constants_.back().as<string>() << "\n";
+        // Every string in the story is interned, so cmps and field lookups can compare atoms.
+        auto text = reader_.read_view();
+        constants_.push_back(collector_.new_string_view(text, rt::atom(text)));
+        std::cout << "\t" << text << "\n";
     }
 
     void Loader::list() {
+        // Items can reference constants further down the pool, so they're filled in by link().
         auto size = reader_.read<u16>();
-        vector<rt::Value> l;
+        vector<Unresolved> items;
         for(u16 i = 0; i < size; ++i) {
-            l.push_back(value());
+            items.push_back(value());
         }
-        constants_.push_back(l);
+        auto list = collector_.new_list();
+        constants_.push_back(list);
+        lists_.push_back({list, std::move(items)});
     }
 
-    Value Loader::value() {
+    Loader::Unresolved Loader::value() {
         auto tag = reader_.read<Tag>();
-        Value val(nil_tag);
+        Unresolved val = Value(nil_tag);
         switch (tag) {
-            case Tag::value_int: val = reader_.read<i32>(); break;
-            case Tag::value_float: val = reader_.read<float>(); break;
+            case Tag::value_int: val = Value(reader_.read<i32>()); break;
+            case Tag::value_float: val = Value(reader_.read<float>()); break;
             case Tag::ref_nil: reader_.forward(4); break;
             case Tag::ref_string:
-                val = Value::Defer{Value::text, reader_.read<u16>()};
+                val = Deferred{Value::text, reader_.read<u16>()};
                 reader_.forward(2);
                 break;
             case Tag::ref_list:
-                val = Value::Defer{Value::list, reader_.read<u16>()};
+                val = Deferred{Value::list, reader_.read<u16>()};
                 reader_.forward(2);
                 break;
             case Tag::ref_object:
-                val = Value::Defer{Value::object, reader_.read<u16>()};
+                val = Deferred{Value::object, reader_.read<u16>()};
+                reader_.forward(2);
+                break;
+            case Tag::ref_function:
+                val = Deferred{Value::function, reader_.read<u16>()};
                 reader_.forward(2);
                 break;
             default: break;
@@ -95,12 +135,12 @@ namespace amyinorbit::compass {
         return val;
     }
 
-    string Loader::name(const Value& val) const {
-        assert(val.type() == Value::text);
-        if(val.is<Value::Defer>()) {
-            return constants_[val.as<Value::Defer>().value].as<string>();
+    Atom Loader::name(const Unresolved& val) const {
+        if(auto ref = std::get_if<Deferred>(&val)) {
+            assert(ref->type == Value::text);
+            return constant<String*>(ref->index)->atom;
         }
-        return val.as<string>();
+        return std::get<Value>(val).as<String*>()->atom;
     }
 
     void Loader::object() {
@@ -110,7 +150,7 @@ namespace amyinorbit::compass {
         u16 prot_ref = reader_.read<u16>();
         u16 name_ref = reader_.read<u16>();
 
-        Object::Fields fields;
+        Fields fields;
         u16 field_count = reader_.read<u16>();
 
         for(u16 i = 0; i < field_count; ++i) {
@@ -122,8 +162,22 @@ namespace amyinorbit::compass {
         objects_.emplace_back(prot_ref, name_ref, std::move(fields));
     }
 
+    void Loader::function() {
+        [[maybe_unused]] auto tag = reader_.read<Tag>();
+        assert(tag == Tag::data_function && "not a function");
+
+        auto name = constant<String*>(reader_.read<u16>())->text();
+        u16 max_stack = reader_.read<u16>();
+        u32 length = reader_.read<u32>();
+
+        const u8* code = reader_.read_bytes(length);
+        functions_.push_back(std::make_unique<Function>(code, length, max_stack));
+        function_names_[name] = functions_.back().get();
+    }
+
     bool Loader::signature() {
         const char signature[] = "CSF2";
+        if(reader_.size() < sizeof(signature) - 1) return false;
         const char* c = signature;
         while(*c) {
             if(reader_.read<char>() != *c) return false;
@@ -133,18 +187,31 @@ namespace amyinorbit::compass {
     }
 
 
-    const Value& Loader::constant(u16 idx, Value::Type type) {
+    const Value& Loader::constant(u16 idx, Value::Type type) const {
         assert(idx < constants_.size());
         const auto& v = constants_[idx];
-        assert(!v.is<Value::Defer>() && v.type() == type);
+        assert(v.type() == type);
 
         return v;
     }
 
     void Loader::link() {
+        for(auto& data: lists_) {
+            for(const auto& item: data.items) {
+                data.list->items.push_back(link_value(item));
+            }
+        }
+        lists_.clear();
+
+        linked_.clear();
         for(u16 i = 0; i < objects_.size(); ++i) {
-            link_object(i);
+            linked_.push_back(link_object(i));
+        }
+
+        for(const auto& data: deferred_constants_) {
+            constants_[data.index] = link_value(data.value);
         }
+        deferred_constants_.clear();
     }
 
     Object* Loader::link_object(u16 idx) {
@@ -156,8 +223,7 @@ namespace amyinorbit::compass {
         if(!data.linked) {
             std::cout << "[obj/" << idx << ": link]\n";
             const Object* prototype = link_object(data.prototype);
-            const string& name = constant<string>(data.name);
-            data.linked = collector_.new_object(prototype, name);
+            data.linked = collector_.new_object(prototype, constant<String*>(data.name)->atom);
 
             for(const auto& [k, v]: data.fields) {
                 data.linked->field(k) = link_value(v);
@@ -167,11 +233,11 @@ namespace amyinorbit::compass {
         return data.linked;
     }
 
-    Value Loader::link_value(const Value& v) {
-        if(!v.is<Value::Defer>()) return v;
-        auto ref = v.as<Value::Defer>();
+    Value Loader::link_value(const Unresolved& v) {
+        if(auto value = std::get_if<Value>(&v)) return *value;
+        auto ref = std::get<Deferred>(v);
 
-        switch(ref.tag) {
+        switch(ref.type) {
             case Value::nil:
             case Value::integer:
             case Value::real:
@@ -180,10 +246,14 @@ namespace amyinorbit::compass {
 
             case Value::text:
             case Value::list:
-                return constant(ref.value, ref.tag);
+                return constant(ref.index, ref.type);
 
             case Value::object:
-                return link_object(ref.value);
+                return link_object(ref.index);
+
+            case Value::function:
+                assert(ref.index < functions_.size() && "invalid function reference");
+                return static_cast<const Function*>(functions_[ref.index].get());
         }
         return nil_tag;
     }
@@ -0,0 +1,702 @@
+//===--------------------------------------------------------------------------------------------===
+// vm.cpp - Bytecode interpreter for the compass 2.0 runtime
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include <compass/runtime2/vm.hpp>
+#include <compass/runtime2/unpack.hpp>
+#include <algorithm>
+#include <cassert>
+#include <sstream>
+#include <string>
+
+// Direct-threaded dispatch needs the labels-as-values extension. CMake turns it on for GCC and
+// Clang; anything else gets the portable switch loop.
+#ifndef COMPASS_THREADED_DISPATCH
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPASS_THREADED_DISPATCH 1
+#else
+#define COMPASS_THREADED_DISPATCH 0
+#endif
+#endif
+
+#ifndef COMPASS_PROFILE_DISPATCH
+#define COMPASS_PROFILE_DISPATCH 0
+#endif
+
+// Stack overflows are caught by the guard pages around the stack, which needs POSIX signals.
+#if defined(__unix__) || defined(__APPLE__)
+#include <csetjmp>
+#include <csignal>
+#include <mutex>
+#define COMPASS_STACK_GUARDS 1
+#else
+#define COMPASS_STACK_GUARDS 0
+#endif
+
+#ifndef COMPASS_HUGE_PAGES
+#define COMPASS_HUGE_PAGES 0
+#endif
+
+namespace amyinorbit::compass {
+
+    template <typename T>
+    static inline i32 compare(const T& a, const T& b) {
+        return (a > b) - (a < b);
+    }
+
+    template <typename T>
+    static inline string to_text(const T& value) {
+        std::ostringstream out;
+        out << value;
+        auto str = out.str();
+        return string(str.data(), str.size());
+    }
+
+    void DispatchProfile::reset() {
+        last_ = 0;
+        std::fill(pairs_.begin(), pairs_.end(), 0);
+    }
+
+    void DispatchProfile::dump(std::ostream& out, u32 count) const {
+        vector<u32> order(pairs_.size());
+        for(u32 i = 0; i < order.size(); ++i) order[i] = i;
+
+        count = std::min<u32>(count, order.size());
+        std::partial_sort(order.begin(), order.begin() + count, order.end(), [&](u32 a, u32 b) {
+            return pairs_[a] > pairs_[b];
+        });
+
+        for(u32 i = 0; i < count && pairs_[order[i]]; ++i) {
+            auto first = static_cast<Bytecode>(order[i] / opcode_count);
+            auto second = static_cast<Bytecode>(order[i] % opcode_count);
+            out << info(first).mnemonic << "; " << info(second).mnemonic
+                << ": " << pairs_[order[i]] << "\n";
+        }
+    }
+
+    // MARK: - Stack guards
+
+#if COMPASS_STACK_GUARDS
+    // The stack of the machine running on this thread, and where to go back to when it faults.
+    struct GuardedRun {
+        const GuardedRegion* stack;
+        sigjmp_buf resume;
+    };
+
+    static thread_local GuardedRun* guarded_run = nullptr;
+    static struct sigaction previous_segv;
+    static struct sigaction previous_bus;
+
+    static void on_fault(int signal, siginfo_t* info, void* context) {
+        if(auto* run = guarded_run) {
+            auto guard = run->stack->guard_at(info->si_addr);
+            if(guard != GuardedRegion::Guard::none) siglongjmp(run->resume, int(guard));
+        }
+
+        // Not a VM stack fault: hand it to whoever was handling it before us.
+        const auto& previous = signal == SIGBUS ? previous_bus : previous_segv;
+        if(previous.sa_flags & SA_SIGINFO) {
+            previous.sa_sigaction(signal, info, context);
+        } else if(previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+            previous.sa_handler(signal);
+        } else {
+            // Returning retries the faulting access, which now gets the default treatment.
+            std::signal(signal, SIG_DFL);
+        }
+    }
+
+    static void install_fault_handler() {
+        static std::once_flag once;
+        std::call_once(once, [] {
+            struct sigaction action = {};
+            action.sa_sigaction = on_fault;
+            action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGSEGV, &action, &previous_segv);
+            sigaction(SIGBUS, &action, &previous_bus);
+        });
+    }
+#endif
+
+    VM::VM() : VM(std::cin, std::cout) {}
+
+    // The stack is the hottest region the interpreter touches.
+    static constexpr auto stack_paging = COMPASS_HUGE_PAGES ? Memory::Paging::huge
+                                                            : Memory::Paging::normal;
+
+    VM::VM(std::istream& in, std::ostream& out)
+        : stack_(10 * mb, stack_paging), in_(in), out_(out) {
+    #if COMPASS_STACK_GUARDS
+        install_fault_handler();
+    #endif
+        // The globals are the first block out of a fresh region, which reads as zeroes -- and nil
+        // is all-zero bits. Leaving them alone means only the pages a story writes get committed.
+        globals_base_ = heap_.alloc(max_globals);
+        collector_.before_collection = [this](rt::Collector& gc) { mark_roots(gc); };
+    }
+
+    void VM::load(const Loader& story) {
+        const auto& constants = story.constants();
+        constants_base_ = constants_.alloc(constants.size());
+        constants_count_ = constants.size();
+        std::copy(constants.begin(), constants.end(), &constant(0));
+
+        objects_ = story.objects();
+        story_young_ = true;
+        story_data_ = story.data();
+    }
+
+    // Builds [fn]'s image (see Function::Instruction). Jumps can land further down, so they are
+    // only resolved once every instruction is in. Field caches are resolved last too, once the
+    // function knows how many it needs. A jump into the middle of an instruction, or out of the
+    // function, fails the whole decode, and the function stays undecoded.
+    bool VM::decode(const Function& fn) {
+        static constexpr u32 no_instruction = u32(-1);
+
+        const u8* code = fn.ip();
+        const u32 size = fn.size();
+        vector<Function::Instruction> image;
+        vector<u32> index_at(size, no_instruction); // offsets inside an instruction have none
+        vector<std::pair<u32, u32>> jumps; // the jump's index, and the offset it lands on
+        vector<u32> fields;
+        u16 caches = 0;
+
+        for(const u8* ip = code; ip < code + size; ) {
+            u32 offset = ip - code;
+            index_at[offset] = image.size();
+
+            auto& inst = image.emplace_back();
+            inst.op = static_cast<Bytecode>(*ip++);
+            inst.offset = offset;
+            u32 operand = read_operand(inst.op, ip);
+
+            switch(inst.op) {
+            case Bytecode::loadc:
+            case Bytecode::writec:
+                inst.constant = &constant(operand);
+                break;
+            case Bytecode::loadg:
+            case Bytecode::storeg:
+                assert(operand < max_globals && "invalid global index");
+                inst.index = operand;
+                inst.global = &global(operand);
+                break;
+            case Bytecode::loadf:
+                inst.constant = &constant(operand & 0xffff);
+                inst.index = operand >> 16;
+                caches = std::max<u16>(caches, inst.index + 1);
+                fields.push_back(image.size() - 1);
+                break;
+            case Bytecode::loadl:
+            case Bytecode::storel:
+            case Bytecode::resv:
+            case Bytecode::call:
+                inst.a = operand;
+                break;
+            case Bytecode::addll:
+                inst.a = operand & 0xff;
+                inst.b = operand >> 8;
+                break;
+            case Bytecode::ioselect:
+            case Bytecode::iostyle:
+            case Bytecode::parse:
+                inst.index = operand;
+                break;
+            default:
+                break;
+            }
+
+            // Jump offsets are relative to the operand.
+            if(is_jump(inst.op)) {
+                u32 at = offset + 1;
+                jumps.emplace_back(image.size() - 1,
+                                   is_backward_jump(inst.op) ? at - operand : at + operand);
+            }
+        }
+
+        // Backward jumps past the start wrap around, and are out of the function too.
+        for(auto [jump, target]: jumps) {
+            if(target >= size || index_at[target] == no_instruction) {
+                runtime_error("decode: jump target is not an instruction");
+                return false;
+            }
+            image[jump].target = &image[index_at[target]];
+        }
+
+        fn.reserve_caches(caches);
+        for(auto field: fields) image[field].cache = &fn.cache(image[field].index);
+        fn.set_image(std::move(image));
+        return true;
+    }
+
+    /*
+    Every minor collection promotes whatever survives it, so after the first one the constants and
+    the story's objects are old. Nothing can be stored in a constant, and objects and lists have a
+    write barrier: minor collections reach young cells from them through the remembered set, and
+    only need the stack and the globals that were given a young cell. Frames don't hold values.
+    */
+    void VM::mark_roots(rt::Collector& gc) {
+        for(Stack::size_type i = 0; i < stack_.size(); ++i) gc.mark(stack_.at(i));
+
+        if(!gc.is_minor()) {
+            for(u16 i = 0; i < constants_count_; ++i) gc.mark(constant(i));
+            for(u32 i = 0; i < globals_count_; ++i) gc.mark(global(i));
+            for(const auto* object: objects_) gc.mark(object);
+            return;
+        }
+
+        if(story_young_) {
+            for(u16 i = 0; i < constants_count_; ++i) gc.mark(constant(i));
+            for(const auto* object: objects_) gc.mark(object);
+            story_young_ = false;
+        }
+        for(auto idx: young_globals_) {
+            gc.mark(global(idx));
+            young_global_[idx] = false;
+        }
+        young_globals_.clear();
+    }
+
+    string VM::text(const rt::Value& value) const {
+        switch(value.type()) {
+        case rt::Value::nil: return "";
+        case rt::Value::integer: return to_text(value.as<i32>());
+        case rt::Value::real: return to_text(value.as<float>());
+        case rt::Value::text: return value.as<rt::String*>()->text();
+        case rt::Value::object: return rt::text(value.as<rt::Object*>()->name());
+        case rt::Value::function: return "<function>";
+        case rt::Value::list:
+            {
+                string result;
+                for(const auto& item: value.as<rt::List*>()->items) {
+                    if(!result.empty()) result += ", ";
+                    result += text(item);
+                }
+                return result;
+            }
+        }
+        return "";
+    }
+
+    VM::Exit VM::runtime_error(const string& message) {
+        error_ = message;
+        return Exit::error;
+    }
+
+    VM::Result VM::run(const Function& fn) {
+        if(!fn.decoded() && !decode(fn)) return Result::error;
+        if(!stack_.has_room(fn.max_stack())) {
+            runtime_error("stack overflow");
+            return Result::error;
+        }
+
+    #if COMPASS_STACK_GUARDS
+        // The fault handler jumps out of the interpreter loop, and destructors are skipped on the
+        // way. Handlers must not touch the stack while a local with a destructor is alive, so
+        // the one that reads a line (ioread) lets it go before pushing the result.
+        GuardedRun run{&stack_.region(), {}};
+        GuardedRun* const outer = guarded_run;
+        const Stack::size_type base = stack_.size();
+
+        if(int fault = sigsetjmp(run.resume, 1)) {
+            guarded_run = outer;
+            stack_.resize(base);
+            runtime_error(fault == int(GuardedRegion::Guard::above)
+                          ? "stack overflow"
+                          : "stack underflow");
+            return Result::error;
+        }
+
+        guarded_run = &run;
+        auto exit = execute(fn, base);
+        guarded_run = outer;
+    #else
+        auto exit = execute(fn, stack_.size());
+    #endif
+        return exit == Exit::error ? Result::error : Result::ok;
+    }
+
+    // MARK: - Interpreter
+
+    // Interprets [fn] with its locals starting at [base]. Calls stay in this loop, with the callers
+    // saved in frame records.
+    VM::Exit VM::execute(const Function& fn, Stack::size_type base) {
+        assert(fn.decoded() && "function was never decoded");
+        const Function* function = &fn;
+        const Function::Instruction* ip = fn.image();
+        const Function::Instruction* inst = ip; // the instruction being run; ip is the next one
+
+        Frame* const frames = frames_.data();
+        Frame* const frames_end = frames + frames_.size();
+        Frame* frame = frames;
+
+        #define POP(T)              stack_.pop().as<T>()
+
+        #define BINARY(T, op)                                                                      \
+            do {                                                                                   \
+                T b = POP(T);                                                                      \
+                T a = POP(T);                                                                      \
+                stack_.push(T(a op b));                                                            \
+            } while(0)
+
+    #if COMPASS_PROFILE_DISPATCH
+        #define PROFILE()           profile_.record(static_cast<u16>(ip->op))
+    #else
+        #define PROFILE()           (void)0
+    #endif
+
+    #if COMPASS_THREADED_DISPATCH
+        #define OPCODE(name, _, __, ___, ____) &&do_##name,
+        static const void* const dispatch_table[] = {
+        #include <compass/runtime2/bytecode.x.hpp>
+        };
+        #undef OPCODE
+
+        #define INSTRUCTION(name)   do_##name
+        #define NEXT()                                                                             \
+            do {                                                                                   \
+                PROFILE();                                                                         \
+                inst = ip++;                                                                       \
+                goto *dispatch_table[static_cast<u8>(inst->op)];                                   \
+            } while(0)
+
+        NEXT();
+    #else
+        #define INSTRUCTION(name)   case Bytecode::name
+        #define NEXT()              continue
+
+        for(;;) switch((PROFILE(), inst = ip++, inst->op)) {
+    #endif
+
+        INSTRUCTION(halt):
+            return Exit::halt;
+
+        // MARK: - Loads and stores
+
+        INSTRUCTION(loadc):
+            stack_.push(*inst->constant);
+            NEXT();
+
+        INSTRUCTION(loadg):
+            stack_.push(*inst->global);
+            NEXT();
+
+        INSTRUCTION(loadl):
+            stack_.push(stack_.at(base + inst->a));
+            NEXT();
+
+        INSTRUCTION(loadf):
+            {
+                const auto* name = inst->constant->as<rt::String*>();
+                auto& cache = *inst->cache;
+                auto object = stack_.pop();
+                if(!object.is<rt::Object*>()) return runtime_error("loadf: not an object");
+
+                const auto* field = object.as<rt::Object*>()->field(name->atom, cache);
+                if(!field) return runtime_error("loadf: no field named '" + name->text() + "'");
+                stack_.push(*field);
+
+                // Only one shape seen so far, with the field in its own slots: quicken.
+                if(cache.size == 1 && cache.entries[0].depth == 0)
+                    function->quicken(inst, Bytecode::loadfs);
+            }
+            NEXT();
+
+        INSTRUCTION(loada):
+            {
+                auto index = stack_.pop();
+                auto list = stack_.pop();
+                if(!list.is<rt::List*>() || !index.is<i32>())
+                    return runtime_error("loada: not a list and index");
+
+                const auto& items = list.as<rt::List*>()->items;
+                u32 i = index.as<i32>();
+                if(i >= items.size()) return runtime_error("loada: index out of bounds");
+                stack_.push(items[i]);
+            }
+            NEXT();
+
+        INSTRUCTION(storeg):
+            store_global(inst->index, stack_.pop());
+            NEXT();
+
+        INSTRUCTION(storel):
+            stack_.at(base + inst->a) = stack_.pop();
+            NEXT();
+
+        INSTRUCTION(storea):
+            {
+                auto value = stack_.pop();
+                auto index = stack_.pop();
+                auto list = stack_.pop();
+                if(!list.is<rt::List*>() || !index.is<i32>())
+                    return runtime_error("storea: not a list and index");
+
+                auto& items = list.as<rt::List*>()->items;
+                u32 i = index.as<i32>();
+                if(i >= items.size()) return runtime_error("storea: index out of bounds");
+                collector_.write_barrier(list.as<rt::List*>());
+                items[i] = value;
+            }
+            NEXT();
+
+        // MARK: - Stack manipulation
+
+        INSTRUCTION(drop):
+            stack_.drop();
+            NEXT();
+
+        INSTRUCTION(dup):
+            {
+                auto top = stack_.peek();
+                stack_.push(top);
+            }
+            NEXT();
+
+        INSTRUCTION(resv):
+            stack_.reserve(inst->a);
+            NEXT();
+
+        // MARK: - Control flow
+
+        INSTRUCTION(jmp):
+            ip = inst->target;
+            NEXT();
+
+        INSTRUCTION(rjmp):
+            ip = inst->target;
+            NEXT();
+
+        INSTRUCTION(jmpz):
+            if(stack_.peek().as<i32>() == 0) ip = inst->target;
+            NEXT();
+
+        INSTRUCTION(rjmpz):
+            if(stack_.peek().as<i32>() == 0) ip = inst->target;
+            NEXT();
+
+        INSTRUCTION(jmpnz):
+            if(stack_.peek().as<i32>() != 0) ip = inst->target;
+            NEXT();
+
+        INSTRUCTION(rjmpnz):
+            if(stack_.peek().as<i32>() != 0) ip = inst->target;
+            NEXT();
+
+        INSTRUCTION(call):
+            {
+                u8 argc = inst->a;
+                auto callee = stack_.pop();
+                if(!callee.is<const Function*>()) return runtime_error("call: not a function");
+
+                const auto* target = callee.as<const Function*>();
+                if(!target->decoded() && !decode(*target)) return Exit::error;
+                if(frame == frames_end) return runtime_error("call: too many nested calls");
+                if(!stack_.has_room(target->max_stack())) return runtime_error("stack overflow");
+                *frame++ = {function, ip, base};
+                function = target;
+                ip = function->image();
+                base = stack_.size() - argc;
+            }
+            NEXT();
+
+        INSTRUCTION(ret):
+            // Returning from the function run() was given leaves the result for the host.
+            if(frame == frames) return Exit::ret;
+            {
+                auto result = stack_.pop();
+                stack_.resize(base);
+                stack_.push(result);
+
+                const auto& caller = *--frame;
+                function = caller.function;
+                ip = caller.ip;
+                base = caller.base;
+            }
+            NEXT();
+
+        // MARK: - Input/Output
+
+        INSTRUCTION(ioselect):
+            device_ = inst->index;
+            NEXT();
+
+        INSTRUCTION(iowrite):
+            out_ << text(stack_.pop());
+            NEXT();
+
+        INSTRUCTION(ioread):
+            {
+                // Waiting for the player is a good time to get some marking done. The line is gone
+                // by the time its string is pushed (see run()).
+                collector_.step();
+                rt::String* str = nullptr;
+                {
+                    std::string line;
+                    std::getline(in_, line);
+                    str = collector_.new_string(string(line.data(), line.size()));
+                }
+                stack_.push(str);
+            }
+            NEXT();
+
+        INSTRUCTION(iostyle):
+            style_ = inst->index;
+            NEXT();
+
+        INSTRUCTION(parse):
+            return runtime_error("parse: no parser is attached to the virtual machine");
+
+        // MARK: - Conversions
+
+        // The operand stays on the stack while the string is allocated, so it is still a root if
+        // the allocation triggers a collection.
+        INSTRUCTION(i2s):
+            {
+                auto str = collector_.new_string(to_text(stack_.peek().as<i32>()));
+                stack_.pop();
+                stack_.push(str);
+            }
+            NEXT();
+
+        INSTRUCTION(i2f):
+            stack_.push((float)POP(i32));
+            NEXT();
+
+        INSTRUCTION(f2s):
+            {
+                auto str = collector_.new_string(to_text(stack_.peek().as<float>()));
+                stack_.pop();
+                stack_.push(str);
+            }
+            NEXT();
+
+        INSTRUCTION(f2i):
+            stack_.push((i32)POP(float));
+            NEXT();
+
+        // MARK: - Arithmetic
+
+        INSTRUCTION(addi): BINARY(i32, +); NEXT();
+        INSTRUCTION(subi): BINARY(i32, -); NEXT();
+        INSTRUCTION(muli): BINARY(i32, *); NEXT();
+
+        INSTRUCTION(divi):
+            if(stack_.peek().as<i32>() == 0) return runtime_error("divi: division by zero");
+            BINARY(i32, /);
+            NEXT();
+
+        INSTRUCTION(cmpi):
+            {
+                i32 b = POP(i32);
+                i32 a = POP(i32);
+                stack_.push(compare(a, b));
+            }
+            NEXT();
+
+        INSTRUCTION(addf): BINARY(float, +); NEXT();
+        INSTRUCTION(subf): BINARY(float, -); NEXT();
+        INSTRUCTION(mulf): BINARY(float, *); NEXT();
+        INSTRUCTION(divf): BINARY(float, /); NEXT();
+
+        INSTRUCTION(cmpf):
+            {
+                float b = POP(float);
+                float a = POP(float);
+                stack_.push(compare(a, b));
+            }
+            NEXT();
+
+        INSTRUCTION(cmps):
+            {
+                const auto* b = POP(rt::String*);
+                const auto* a = POP(rt::String*);
+                // Atoms are unique, so equal story strings never need their text compared.
+                bool same = a == b || (a->atom == b->atom && a->atom != rt::String::no_atom);
+                stack_.push(same ? 0 : compare(a->data, b->data));
+
+                if(a->atom != rt::String::no_atom && b->atom != rt::String::no_atom)
+                    function->quicken(inst, Bytecode::cmpsa);
+            }
+            NEXT();
+
+        // MARK: - Superinstructions
+
+        INSTRUCTION(addll):
+            {
+                i32 a = stack_.at(base + inst->a).as<i32>();
+                i32 b = stack_.at(base + inst->b).as<i32>();
+                stack_.push(a + b);
+            }
+            NEXT();
+
+        INSTRUCTION(cmpijz):
+            {
+                i32 b = POP(i32);
+                i32 a = POP(i32);
+                i32 result = compare(a, b);
+                stack_.push(result);
+                if(result == 0) ip = inst->target;
+            }
+            NEXT();
+
+        INSTRUCTION(writec):
+            out_ << text(*inst->constant);
+            NEXT();
+
+        // MARK: - Quickened instructions
+
+        // When a guard fails, the instruction goes back to its generic form, which then runs with
+        // the stack untouched. loadf only quickens again while its cache is monomorphic, so a site
+        // that has seen a second shape stays generic. Guards call NEXT() directly: wrapped in a loop,
+        // the switch build's `continue` would only leave the loop and fall into the fast path.
+
+        INSTRUCTION(loadfs):
+            {
+                const auto& entry = inst->cache->entries[0];
+                const auto& object = stack_.peek();
+                if(!object.is<rt::Object*>() || object.as<rt::Object*>()->shape() != entry.shape) {
+                    function->quicken(inst, Bytecode::loadf);
+                    ip = inst;
+                    NEXT();
+                }
+
+                auto value = object.as<rt::Object*>()->slots()[entry.slot];
+                stack_.pop();
+                stack_.push(value);
+            }
+            NEXT();
+
+        INSTRUCTION(cmpsa):
+            {
+                const auto* b = stack_.peek().as<rt::String*>();
+                const auto* a = stack_.at(stack_.size() - 2).as<rt::String*>();
+                if(a->atom == rt::String::no_atom || b->atom == rt::String::no_atom) {
+                    function->quicken(inst, Bytecode::cmps);
+                    ip = inst;
+                    NEXT();
+                }
+
+                stack_.pop();
+                stack_.pop();
+                stack_.push(a->atom == b->atom ? 0 : compare(a->data, b->data));
+            }
+            NEXT();
+
+    #if !COMPASS_THREADED_DISPATCH
+        default:
+            return runtime_error("invalid instruction");
+        }
+    #endif
+
+        #undef INSTRUCTION
+        #undef NEXT
+        #undef PROFILE
+        #undef BINARY
+        #undef POP
+    }
+}
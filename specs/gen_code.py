@@ -13,7 +13,7 @@ class OpcodeEnum:
         self.out.write('namespace amyinorbit::compass {\n')
         self.out.write('    enum class Opcode {\n')
 
-    def instruction(self, mnemonic, instruction, operands, stack, comments=None):
+    def instruction(self, mnemonic, instruction, operands, varints, stack, comments=None):
         self.out.write('        %s = 0x%02x,\n' % (mnemonic, instruction))
 
     def end(self):
@@ -29,12 +29,14 @@ class AssemblyTable:
         self.out.write('#include <compass/types.hpp>\n')
         self.out.write('#include <compass/bytecode.hpp>\n')
         self.out.write('namespace amyinorbit::compass {\n')
-        self.out.write('struct InstructionData { Opcode op; i8 operands; i8 stack; };')
+        # operands is a size in bytes, and 0 for instructions that take varints instead.
+        self.out.write('    struct InstructionData { Opcode op; i8 operands; i8 varints; i8 stack; };\n')
 
         self.out.write('    static const map<string, InstructionData> instruction_data = {\n')
 
-    def instruction(self, mnemonic, instruction, operands, stack, comments=None):
-        self.out.write('        {\"%s\", {Opcode::%s, %d, %d}},\n' % (mnemonic, mnemonic, operands, stack))
+    def instruction(self, mnemonic, instruction, operands, varints, stack, comments=None):
+        self.out.write('        {\"%s\", {Opcode::%s, %d, %d, %d}},\n'
+                       % (mnemonic, mnemonic, operands, varints, stack))
 
     def end(self):
         self.out.write('    };\n')
@@ -45,13 +47,14 @@ class XMacro:
         self.out = out
 
     def start(self):
+        # no include guard: the x-macro file is meant to be included once per OPCODE() definition
         self.out.write('// generated by gen_code.py\n')
-        self.out.write('#pragma once\n')
         self.out.write('\n\n')
 
-    def instruction(self, mnemonic, instruction, operands, stack, comments=None):
+    def instruction(self, mnemonic, instruction, operands, varints, stack, comments=None):
         self.out.write(
-            'OPCODE(%-10s, 0x%02x, %+3d, %+3d)' % (mnemonic, instruction, operands, stack))
+            'OPCODE(%-10s, 0x%02x, %+3d, %d, %+3d)'
+            % (mnemonic, instruction, operands, varints, stack))
         if comments:
             self.out.write(' // %s' % comments)
         self.out.write('\n')
@@ -107,13 +110,19 @@ def main():
                 fields = p.split(line)
 
                 code = fields[headers['code']]
-                ops = int(fields[headers['operands']])
+                ops = fields[headers['operands']]
                 stack = int(fields[headers['stack']])
 
+                # operands are either a size in bytes, or one 'v' per variable-length integer.
+                if ops.strip('v') == '':
+                    ops, varints = 0, len(ops)
+                else:
+                    ops, varints = int(ops), 0
+
                 if 'comments' in headers and len(fields) > headers['comments']:
-                    gen.instruction(code, instr, ops, stack, fields[headers['comments']])
+                    gen.instruction(code, instr, ops, varints, stack, fields[headers['comments']])
                 else:
-                    gen.instruction(code, instr, ops, stack)
+                    gen.instruction(code, instr, ops, varints, stack)
                 instr += 1
         gen.end()
 
@@ -0,0 +1,212 @@
+//===--------------------------------------------------------------------------------------------===
+// memory_tests.cpp - Tests for the runtime memory manager
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include <compass/runtime2/memory.hpp>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace amyinorbit::compass;
+using size_type = Memory::size_type;
+
+// Not assert(), so that the checks still run in release builds.
+#define CHECK(cond) do {                                                                        \
+        if(!(cond)) {                                                                           \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n";          \
+            std::exit(1);                                                                       \
+        }                                                                                       \
+    } while(0)
+
+struct Block {
+    size_type address;
+    size_type slots;
+    u8 fill;
+};
+
+// Every byte of the buffer is either in a block's payload or in a block's tags.
+static size_type overhead(const Memory& memory) {
+    auto stats = memory.stats();
+    return (stats.capacity - stats.used - stats.free) / (stats.used_blocks + stats.free_blocks);
+}
+
+static void check(const Memory& memory, const std::vector<Block>& live, size_type tags) {
+    CHECK(memory.verify());
+
+    auto stats = memory.stats();
+    size_type requested = 0;
+    for(const auto& block: live) requested += std::max<size_type>(block.slots, 1) * Memory::align;
+
+    CHECK(stats.used_blocks == live.size());
+    CHECK(stats.used >= requested);
+    CHECK(stats.largest_free <= stats.free);
+    CHECK(stats.free_blocks || !stats.free);
+    CHECK(stats.used + stats.free + tags * (stats.used_blocks + stats.free_blocks)
+          == stats.capacity);
+}
+
+// Blocks are filled with a pattern when allocated. If two blocks overlap, or the allocator writes
+// into a live one, the pattern is broken by the time it is freed.
+static void fill(Memory& memory, const Block& block) {
+    auto* data = memory.ptr<u8>(block.address);
+    for(size_type i = 0; i < block.slots * Memory::align; ++i) data[i] = block.fill;
+}
+
+static bool intact(Memory& memory, const Block& block) {
+    auto* data = memory.ptr<u8>(block.address);
+    for(size_type i = 0; i < block.slots * Memory::align; ++i) {
+        if(data[i] != block.fill) return false;
+    }
+    return true;
+}
+
+// MARK: - Tests
+
+static void test_random() {
+    Memory memory(256 * 1024);
+    const auto tags = overhead(memory);
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<u32> coin(0, 99);
+    std::uniform_int_distribution<size_type> small(0, Memory::small_limit / Memory::align - 1);
+    std::uniform_int_distribution<size_type> large(Memory::small_limit / Memory::align, 2048);
+
+    std::vector<Block> live;
+    u32 failures = 0;
+    for(u32 step = 0; step < 20000; ++step) {
+        if(live.empty() || coin(rng) < 60) {
+            size_type slots = coin(rng) < 80 ? small(rng) : large(rng);
+            size_type address = memory.alloc(slots);
+            if(address) {
+                live.push_back({address, slots, u8(step)});
+                fill(memory, live.back());
+            } else {
+                // Running out is only allowed when no free block is big enough.
+                failures += 1;
+                CHECK(memory.stats().largest_free < std::max<size_type>(slots, 1) * Memory::align);
+            }
+        } else {
+            std::uniform_int_distribution<std::size_t> pick(0, live.size() - 1);
+            auto i = pick(rng);
+            CHECK(intact(memory, live[i]));
+            memory.dealloc(live[i].address);
+            live[i] = live.back();
+            live.pop_back();
+        }
+        check(memory, live, tags);
+    }
+    CHECK(failures > 0); // the heap is small enough to fill up
+
+    for(const auto& block: live) {
+        CHECK(intact(memory, block));
+        memory.dealloc(block.address);
+    }
+    live.clear();
+    check(memory, live, tags);
+
+    auto stats = memory.stats();
+    CHECK(stats.free_blocks == 1);
+    CHECK(stats.largest_free == stats.capacity - tags);
+}
+
+static void test_coalescing() {
+    Memory memory(4096);
+    const auto tags = overhead(memory);
+    const size_type size = 4 * Memory::align;
+
+    auto a = memory.alloc(4);
+    auto b = memory.alloc(4);
+    auto c = memory.alloc(4);
+    auto d = memory.alloc(4); // keeps c away from the free space at the end
+    CHECK(a && b && c && d);
+    CHECK(memory.stats().free_blocks == 1);
+
+    memory.dealloc(a);
+    memory.dealloc(c);
+    CHECK(memory.verify());
+    CHECK(memory.stats().free_blocks == 3);
+
+    // b merges with the free blocks on both sides.
+    memory.dealloc(b);
+    CHECK(memory.verify());
+    auto stats = memory.stats();
+    CHECK(stats.free_blocks == 2);
+    CHECK(stats.used_blocks == 1);
+
+    // The merged block is reused whole, starting where a did.
+    CHECK(memory.alloc(3 * size / Memory::align + 2 * tags / Memory::align) == a);
+    memory.dealloc(a);
+
+    // d merges with the block it left before it, and with the rest of the buffer after it.
+    memory.dealloc(d);
+    CHECK(memory.verify());
+    stats = memory.stats();
+    CHECK(stats.free_blocks == 1);
+    CHECK(stats.used_blocks == 0);
+    CHECK(stats.largest_free == stats.capacity - tags);
+}
+
+static void test_size_classes() {
+    Memory memory(64 * 1024);
+    const size_type below = Memory::small_limit / Memory::align - 1;
+    const size_type at = Memory::small_limit / Memory::align;
+
+    // Allocated blocks between the test ones keep them from merging when they are freed.
+    auto small = memory.alloc(below);
+    auto guard_1 = memory.alloc(1);
+    auto large = memory.alloc(at);
+    auto guard_2 = memory.alloc(1);
+    CHECK(small && guard_1 && large && guard_2);
+
+    memory.dealloc(small);
+    memory.dealloc(large);
+    CHECK(memory.verify());
+    CHECK(memory.stats().free_blocks == 3);
+
+    // The largest small block is too small for a request at the limit, and is passed over.
+    auto other = memory.alloc(at);
+    CHECK(other == large);
+    CHECK(memory.verify());
+    memory.dealloc(other);
+
+    // Each request gets the exact-size block back from its own list.
+    CHECK(memory.alloc(below) == small);
+    CHECK(memory.alloc(at) == large);
+    CHECK(memory.verify());
+    CHECK(memory.stats().free_blocks == 1);
+}
+
+static void test_exhaustion() {
+    Memory memory(1024);
+    const auto tags = overhead(memory);
+    const auto capacity = memory.stats().capacity;
+    const size_type slots = (capacity - tags) / Memory::align;
+
+    CHECK(memory.alloc(slots + 1) == 0);
+    CHECK(memory.verify());
+
+    auto all = memory.alloc(slots);
+    CHECK(all);
+    CHECK(memory.verify());
+    CHECK(memory.stats().free_blocks == 0);
+    CHECK(memory.alloc(1) == 0);
+    CHECK(memory.alloc(0) == 0);
+    CHECK(memory.verify());
+
+    memory.dealloc(all);
+    CHECK(memory.verify());
+    CHECK(memory.stats().largest_free == capacity - tags);
+}
+
+int main() {
+    test_coalescing();
+    test_size_classes();
+    test_exhaustion();
+    test_random();
+    std::cout << "memory: all tests passed\n";
+    return 0;
+}
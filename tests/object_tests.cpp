@@ -0,0 +1,84 @@
+//===--------------------------------------------------------------------------------------------===
+// object_tests.cpp - Tests for runtime objects and the values they hold
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include "story_builder.hpp"
+#include <compass/runtime2/collector.hpp>
+
+using namespace amyinorbit;
+using namespace amyinorbit::compass;
+using namespace amyinorbit::compass::rt;
+
+// Reads go through the const accessors: the other field() is only for writing.
+static vector<Value>& items(const Object* object) {
+    return object->field("items").as<List*>()->items;
+}
+
+static vector<Value>& items(const Value& list) {
+    return list.as<List*>()->items;
+}
+
+// Lists are values: a clone gets copies of the lists the original has, and of lists in those.
+// Changing one leaves the other alone.
+static void test_clones_copy_lists() {
+    Collector gc;
+    auto* lamp = gc.new_object(nullptr, atom("lamp"));
+    gc.push_root(lamp);
+    lamp->field("items") = gc.new_list({Value(1), gc.new_list({Value(2)})});
+
+    // Fill the nursery up to where the clone's first list copy starts a collection. The clone
+    // survives it, and is promoted before its lists are all in.
+    auto collections = gc.counters().minor_collections;
+    while(gc.counters().minor_collections == collections) gc.new_string("garbage");
+    for(u16 i = 0; i + 2 < Collector::nursery_size; ++i) gc.new_string("garbage");
+
+    collections = gc.counters().minor_collections;
+    auto* copy = gc.clone(lamp);
+    gc.push_root(copy);
+    CHECK(gc.counters().minor_collections == collections + 1);
+
+    items(items(lamp)[1]).push_back(Value(3));
+    CHECK(items(items(copy)[1]).size() == 1);
+
+    items(copy).clear();
+    CHECK(items(lamp).size() == 2);
+    CHECK(items(lamp)[0].as<i32>() == 1);
+
+    gc.pop_root();
+    gc.pop_root();
+}
+
+// An object that inherits a list gets a copy of its own the first time it writes the field.
+static void test_inherited_lists_are_copied() {
+    Collector gc;
+    auto* thing = gc.new_object(nullptr, atom("thing"));
+    gc.push_root(thing);
+    thing->field("items") = gc.new_list({Value(1), gc.new_list({Value(2)})});
+
+    auto* lamp = gc.new_object(thing, atom("lamp"));
+    gc.push_root(lamp);
+    CHECK(&items(lamp) == &items(thing));
+
+    lamp->field("items");
+    items(lamp).push_back(Value(3));
+    items(items(lamp)[1]).push_back(Value(4));
+
+    CHECK(items(thing).size() == 2);
+    CHECK(items(items(thing)[1]).size() == 1);
+    CHECK(items(lamp).size() == 3);
+    CHECK(items(items(lamp)[1]).size() == 2);
+
+    gc.pop_root();
+    gc.pop_root();
+}
+
+int main() {
+    test_clones_copy_lists();
+    test_inherited_lists_are_copied();
+    std::cout << "object: all tests passed\n";
+    return 0;
+}
@@ -0,0 +1,107 @@
+//===--------------------------------------------------------------------------------------------===
+// quicken_tests.cpp - Tests for the interpreter's quickened instructions
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include "story_builder.hpp"
+#include <compass/runtime2/unpack.hpp>
+#include <compass/runtime2/vm.hpp>
+#include <sstream>
+
+using namespace amyinorbit;
+using namespace amyinorbit::compass;
+using test::StoryBuilder;
+
+/*
+Runs a story that gets each quickened instruction to fail its guard, once it has quickened:
+
+ - `get` reads field x of a, then of b, which has a different shape (loadfs);
+ - `cmp` compares constant strings, which are atoms, then strings made by i2s, which aren't (cmpsa).
+
+Both guards hand the instruction back to its generic form, which has to give the right result.
+This is built once per dispatch mode (see tests/CMakeLists.txt).
+*/
+int main() {
+    StoryBuilder story;
+    u16 x = story.add_string("x");
+    u16 y = story.add_string("y");
+    u16 a = story.add_object(story.add_string("a"), {{x, StoryBuilder::integer(11)}});
+    u16 b = story.add_object(story.add_string("b"), {
+        {y, StoryBuilder::integer(0)},
+        {x, StoryBuilder::integer(22)},
+    });
+
+    u16 obj_a = story.add_constant(StoryBuilder::object_ref(a));
+    u16 obj_b = story.add_constant(StoryBuilder::object_ref(b));
+    u16 get_ref = story.add_constant(StoryBuilder::function_ref(0));
+    u16 cmp_ref = story.add_constant(StoryBuilder::function_ref(1));
+    u16 apple = story.add_string("apple");
+    u16 pear = story.add_string("pear");
+    u16 three = story.add_constant(StoryBuilder::integer(3));
+    u16 twelve = story.add_constant(StoryBuilder::integer(12));
+    u16 space = story.add_string(" ");
+
+    Function get;
+    get.emit(Bytecode::loadl, 0);
+    get.emitField(x);
+    get.emit(Bytecode::ret);
+
+    Function cmp;
+    cmp.emit(Bytecode::loadl, 0);
+    cmp.emit(Bytecode::loadl, 1);
+    cmp.emit(Bytecode::cmps);
+    cmp.emit(Bytecode::ret);
+
+    Function main_fn;
+    for(u16 object: {obj_a, obj_a, obj_b}) {
+        main_fn.emit(Bytecode::loadc, object);
+        main_fn.emit(Bytecode::loadc, get_ref);
+        main_fn.emit(Bytecode::call, 1);
+        main_fn.emit(Bytecode::iowrite);
+        main_fn.emit(Bytecode::writec, space);
+    }
+    for(auto [lhs, rhs]: {std::pair{apple, pear}, {pear, pear}}) {
+        main_fn.emit(Bytecode::loadc, lhs);
+        main_fn.emit(Bytecode::loadc, rhs);
+        main_fn.emit(Bytecode::loadc, cmp_ref);
+        main_fn.emit(Bytecode::call, 2);
+        main_fn.emit(Bytecode::iowrite);
+        main_fn.emit(Bytecode::writec, space);
+    }
+    for(auto [lhs, rhs]: {std::pair{three, twelve}, {twelve, twelve}}) {
+        main_fn.emit(Bytecode::loadc, lhs);
+        main_fn.emit(Bytecode::i2s);
+        main_fn.emit(Bytecode::loadc, rhs);
+        main_fn.emit(Bytecode::i2s);
+        main_fn.emit(Bytecode::loadc, cmp_ref);
+        main_fn.emit(Bytecode::call, 2);
+        main_fn.emit(Bytecode::iowrite);
+        main_fn.emit(Bytecode::writec, space);
+    }
+    main_fn.emit(Bytecode::halt);
+
+    story.add_function(story.add_string("get"), get);
+    story.add_function(story.add_string("cmp"), cmp);
+    story.add_function(story.add_string("main"), main_fn);
+
+    std::stringstream file(story.build());
+
+    std::stringstream out;
+    VM vm(std::cin, out);
+    Loader loader(vm.collector(), file);
+    loader.load();
+    vm.load(loader);
+
+    CHECK(vm.run(*loader.function("main")) == VM::Result::ok);
+    CHECK(out.str() == "11 11 22 -1 0 1 0 ");
+
+    // Both sites have seen values their quickened form can't handle, and are generic again.
+    CHECK(loader.function("get")->image()[1].op == Bytecode::loadf);
+    CHECK(loader.function("cmp")->image()[2].op == Bytecode::cmps);
+
+    std::cout << "quicken: all tests passed\n";
+    return 0;
+}
@@ -0,0 +1,139 @@
+//===--------------------------------------------------------------------------------------------===
+// story_builder.hpp - Writes small story files for the runtime tests
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#pragma once
+#include <compass/runtime2/bin_io.hpp>
+#include <compass/runtime2/function.hpp>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+// Not assert(), so that the checks still run in release builds.
+#define CHECK(cond) do {                                                                        \
+        if(!(cond)) {                                                                           \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n";          \
+            std::exit(1);                                                                       \
+        }                                                                                       \
+    } while(0)
+
+namespace amyinorbit::compass::test {
+
+    /*
+    Builds a story file the way the compiler lays it out (see specs/story-file.txt), without the
+    compiler: the runtime tests only link the runtime. Everything is added by hand, and referred to
+    by the index the add_ functions return. Function bytecode is written as is, so it has to be
+    valid -- nothing verifies it.
+    */
+    class StoryBuilder {
+    public:
+        // A value stored in a list or an object field: a scalar, or a reference to a constant,
+        // an object or a function.
+        struct Item {
+            Tag tag;
+            u32 bits;
+        };
+
+        static Item integer(i32 value) { return {Tag::value_int, u32(value)}; }
+        static Item string_ref(u16 constant) { return {Tag::ref_string, constant}; }
+        static Item list_ref(u16 constant) { return {Tag::ref_list, constant}; }
+        static Item object_ref(u16 object) { return {Tag::ref_object, object}; }
+        static Item function_ref(u16 function) { return {Tag::ref_function, function}; }
+
+        u16 add_constant(Item value) {
+            write_item(constants_, value);
+            return constant_count_++;
+        }
+
+        u16 add_string(const std::string& text) {
+            constants_.write(Tag::data_utf8);
+            constants_.write(u32(text.size() + 1));
+            constants_.write(text.data(), u32(text.size()));
+            return constant_count_++;
+        }
+
+        u16 add_list(const vector<Item>& items) {
+            constants_.write(Tag::data_list);
+            constants_.write(u16(items.size()));
+            for(const auto& item: items) write_item(constants_, item);
+            return constant_count_++;
+        }
+
+        // [name] is a string constant, [prototype] an object index or no_object.
+        static constexpr u16 no_object = 0xffff;
+        u16 add_object(u16 name, const vector<std::pair<u16, Item>>& fields,
+                       u16 prototype = no_object) {
+            heap_.write(Tag::data_object);
+            heap_.write(prototype);
+            heap_.write(name);
+            heap_.write(u16(fields.size()));
+            for(const auto& [key, value]: fields) {
+                write_item(heap_, string_ref(key));
+                write_item(heap_, value);
+            }
+            return object_count_++;
+        }
+
+        u16 add_function(u16 name, const Function& fn, u16 max_stack = 16) {
+            const auto& code = fn.code();
+            functions_.write(Tag::data_function);
+            functions_.write(name);
+            functions_.write(max_stack);
+            functions_.write(u32(code.size()));
+            functions_.write(reinterpret_cast<const char*>(code.data()), u32(code.size()));
+            return function_count_++;
+        }
+
+        std::string build() const {
+            BufferWriter out;
+            out.write("CSF2", 4);
+            for(int i = 0; i < 7; ++i) out.write<u32>(0xffffffff);
+
+            u32 heap_offset = append(out, object_count_, heap_);
+            u32 globals_offset = append(out, 0, BufferWriter());
+            u32 functions_offset = append(out, function_count_, functions_);
+            u32 constants_offset = append(out, constant_count_, constants_);
+
+            out.go(4);
+            out.write(functions_offset);
+            out.go(4 + 4 * sizeof(u32));
+            out.write(heap_offset);
+            out.write(globals_offset);
+            out.write(constants_offset);
+            return std::string(reinterpret_cast<const char*>(out.data()), out.size());
+        }
+
+    private:
+        static void write_item(BufferWriter& out, Item item) {
+            out.write(item.tag);
+            if(item.tag == Tag::value_int) {
+                out.write(item.bits);
+            } else {
+                out.write(u16(item.bits));
+                out.write(u16(0));
+            }
+        }
+
+        // Writes a section's count and contents at the end of [out], and returns where it starts.
+        static u32 append(BufferWriter& out, u16 count, const BufferWriter& section) {
+            out.go(out.size());
+            u32 offset = out.size();
+            out.write(count);
+            if(section.size()) {
+                out.write(reinterpret_cast<const char*>(section.data()), u32(section.size()));
+            }
+            return offset;
+        }
+
+        BufferWriter constants_;
+        BufferWriter heap_;
+        BufferWriter functions_;
+        u16 constant_count_ = 0;
+        u16 object_count_ = 0;
+        u16 function_count_ = 0;
+    };
+}
@@ -0,0 +1,98 @@
+//===--------------------------------------------------------------------------------------------===
+// vm_tests.cpp - Tests for the virtual machine's calls and errors
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2020 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include "story_builder.hpp"
+#include <compass/runtime2/unpack.hpp>
+#include <compass/runtime2/vm.hpp>
+#include <sstream>
+
+using namespace amyinorbit;
+using namespace amyinorbit::compass;
+using test::StoryBuilder;
+
+// A story stopped by an error leaves its call frames behind. The next run must start from the
+// bottom of the frame array again, or enough failed runs make every call a nesting error.
+static void test_errors_release_frames() {
+    StoryBuilder story;
+    u16 fail_ref = story.add_constant(StoryBuilder::function_ref(0));
+    u16 middle_ref = story.add_constant(StoryBuilder::function_ref(1));
+
+    // The error comes two calls deep, so that the run has frames in use when it stops.
+    Function fail;
+    fail.emit(Bytecode::parse);
+
+    Function middle;
+    middle.emit(Bytecode::loadc, fail_ref);
+    middle.emit(Bytecode::call, 0);
+    middle.emit(Bytecode::ret);
+
+    Function main_fn;
+    main_fn.emit(Bytecode::loadc, middle_ref);
+    main_fn.emit(Bytecode::call, 0);
+    main_fn.emit(Bytecode::halt);
+
+    story.add_function(story.add_string("fail"), fail);
+    story.add_function(story.add_string("middle"), middle);
+    story.add_function(story.add_string("main"), main_fn);
+
+    std::stringstream file(story.build());
+    std::stringstream in, out;
+    VM vm(in, out);
+    Loader loader(vm.collector(), file);
+    loader.load();
+    vm.load(loader);
+
+    for(u32 i = 0; i < 2 * VM::max_frames; ++i) {
+        CHECK(vm.run(*loader.function("main")) == VM::Result::error);
+        CHECK(vm.error() == "parse: no parser is attached to the virtual machine");
+        vm.stack().resize(0);
+    }
+}
+
+// Jump offsets are relative to the operand, which starts one byte after the jump (offset 1 here).
+// The jump is three bytes long and halt comes right after it, at offset 3.
+static void test_jump_targets() {
+    StoryBuilder story;
+    u16 inside_ref = story.add_constant(StoryBuilder::function_ref(1));
+    // Onto halt, into the jump's own operand, and out of the function.
+    const std::pair<const char*, u16> jumps[] = {{"good", 2}, {"inside", 1}, {"out", 100}};
+    for(auto [name, distance]: jumps) {
+        Function fn;
+        fn.emit(Bytecode::jmp, distance);
+        fn.emit(Bytecode::halt);
+        story.add_function(story.add_string(name), fn);
+    }
+
+    Function main_fn;
+    main_fn.emit(Bytecode::loadc, inside_ref);
+    main_fn.emit(Bytecode::call, 0);
+    main_fn.emit(Bytecode::halt);
+    story.add_function(story.add_string("main"), main_fn);
+
+    std::stringstream file(story.build());
+    std::stringstream in, out;
+    VM vm(in, out);
+    Loader loader(vm.collector(), file);
+    loader.load();
+    vm.load(loader);
+
+    CHECK(vm.run(*loader.function("good")) == VM::Result::ok);
+    for(const char* name: {"inside", "out", "main"}) {
+        CHECK(vm.run(*loader.function(name)) == VM::Result::error);
+        CHECK(vm.error() == "decode: jump target is not an instruction");
+    }
+    CHECK(!loader.function("inside")->decoded());
+    CHECK(!loader.function("out")->decoded());
+}
+
+int main() {
+    test_errors_release_frames();
+    test_jump_targets();
+    std::cout << "vm: all tests passed\n";
+    return 0;
+}